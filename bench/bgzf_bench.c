@@ -0,0 +1,301 @@
+/*-------------------------------------------------------------------------
+ *
+ * bench/bgzf_bench.c
+ *
+ * Native benchmark of the BGZF core (src/bgzf.c), without a server:
+ * compression and decompression throughput, and ratio, for each combination of
+ * corpus, level, block size and number of threads. Results go to stdout, as JSON.
+ *
+ *   make bench
+ *   ./bench/bgzf_bench -s 64 -l 1,6,9 -b 16384,65280 -t 1,4 -c text,random
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bgzf.h"
+
+#define MB (1000.0 * 1000.0)
+
+typedef struct bench_job {
+  const uint8_t *in;
+  size_t in_size;
+  size_t block_size;
+  uint8_t *out;             /* compress: one block per stride; decompress: the blocks */
+  size_t stride;
+  size_t *sizes;
+  double stored_entropy;
+  const bgzf_block *blocks; /* decompress */
+  uint8_t *dst;
+  struct libdeflate_compressor *z[BGZF_MAX_THREADS];
+  struct libdeflate_decompressor *d[BGZF_MAX_THREADS];
+} bench_job;
+
+static int
+bench_compress_task(void *arg, size_t block, int worker)
+{
+  bench_job *bj = (bench_job *)arg;
+  size_t offset = block * bj->block_size;
+  size_t isize = bj->in_size - offset;
+  size_t dlen = bj->stride;
+
+  if (isize > bj->block_size) isize = bj->block_size;
+
+  if (bgzf_compress_block(bj->z[worker], bj->out + block * bj->stride, &dlen,
+			  bj->in + offset, isize, bj->stored_entropy) < 0)
+    return -1;
+  bj->sizes[block] = dlen;
+  return 0;
+}
+
+static int
+bench_uncompress_task(void *arg, size_t block, int worker)
+{
+  bench_job *bj = (bench_job *)arg;
+  const bgzf_block *b = &bj->blocks[block];
+
+  return bgzf_uncompress_block(bj->d[worker], bj->dst + b->uoffset, bj->out + b->coffset, b, true);
+}
+
+static int
+bench_run(bench_job *bj, int nthreads, size_t ntasks, bgzf_task_fn fn)
+{
+  bgzf_job job;
+
+  bgzf_job_start(&job, nthreads, ntasks, fn, bj, NULL, NULL);
+  return (bgzf_job_wait(&job) == SIZE_MAX) ? 0 : -1;
+}
+
+/*
+ * Corpora: deterministic, so that runs compare
+ */
+static uint64_t bench_seed = 88172645463325252ULL;
+
+static inline uint64_t
+bench_random(void)
+{
+  /* xorshift64 */
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 7;
+  bench_seed ^= bench_seed << 17;
+  return bench_seed;
+}
+
+static const char *const bench_words[] = {
+  "the", "of", "and", "to", "in", "block", "gzip", "compressed", "data", "is",
+  "postgres", "with", "for", "on", "that", "by", "this", "as", "bgzf", "from",
+  "table", "index", "header", "footer", "value", "stream", "level", "thread",
+};
+
+static void
+bench_corpus(const char *name, uint8_t *buf, size_t size)
+{
+  size_t i = 0, n, col = 0;
+
+  if (strcmp(name, "zeros") == 0)
+    memset(buf, 0, size);
+  else if (strcmp(name, "random") == 0) {
+    for (i = 0; i < size; i++)
+      buf[i] = (uint8_t)bench_random();
+  }
+  else if (strcmp(name, "dna") == 0) {
+    /* FASTA-like: 60 bases per line */
+    for (i = 0; i < size; i++)
+      buf[i] = (i % 61 == 60) ? '\n' : "ACGT"[bench_random() & 3];
+  }
+  else { /* text */
+    while (i < size) {
+      const char *w = bench_words[bench_random() % (sizeof(bench_words) / sizeof(bench_words[0]))];
+      n = strlen(w);
+      if (n > size - i) n = size - i;
+      memcpy(buf + i, w, n);
+      i += n;
+      col += n + 1;
+      if (i < size)
+	buf[i++] = (col > 72) ? '\n' : ' ';
+      if (col > 72) col = 0;
+    }
+  }
+}
+
+/* Comma-separated list of integers */
+static int
+bench_parse_list(const char *s, long *list, int max)
+{
+  int n = 0;
+  char *end;
+
+  while (*s && n < max) {
+    list[n++] = strtol(s, &end, 0);
+    if (end == s) {
+      fprintf(stderr, "Invalid list: %s\n", s);
+      exit(1);
+    }
+    s = (*end == ',') ? end + 1 : end;
+  }
+  return n;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+	  "Usage: %s [-s MB] [-l levels] [-b block sizes] [-t threads] [-c corpora] [-e entropy] [-m seconds]\n"
+	  "  -s  size of each corpus, in MB (default 64)\n"
+	  "  -l  compression levels (default 1,6,9)\n"
+	  "  -b  block sizes, up to %d (default %d)\n"
+	  "  -t  numbers of threads (default 1)\n"
+	  "  -c  corpora, among text, random, zeros and dna (default text,random,zeros,dna)\n"
+	  "  -e  entropy from which blocks are stored (default 8: never)\n"
+	  "  -m  minimum time of each measure, in seconds (default 0.2)\n",
+	  prog, BGZF_BLOCK_SIZE, BGZF_BLOCK_SIZE);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  double size_mb = 64, stored_entropy = 8.0, min_time = 0.2;
+  long levels[16] = { 1, 6, 9 }, block_sizes[16] = { BGZF_BLOCK_SIZE }, threads[16] = { 1 };
+  int nlevels = 3, nblock_sizes = 1, nthreads = 1;
+  char corpora_arg[256] = "text,random,zeros,dna";
+  char *corpus;
+  size_t size;
+  uint8_t *in, *dst;
+  bool first = true;
+  int opt, li, bi, ti, i;
+
+  while ((opt = getopt(argc, argv, "s:l:b:t:c:e:m:h")) != -1) {
+    switch (opt) {
+    case 's': size_mb = atof(optarg); break;
+    case 'l': nlevels = bench_parse_list(optarg, levels, 16); break;
+    case 'b': nblock_sizes = bench_parse_list(optarg, block_sizes, 16); break;
+    case 't': nthreads = bench_parse_list(optarg, threads, 16); break;
+    case 'c': snprintf(corpora_arg, sizeof(corpora_arg), "%s", optarg); break;
+    case 'e': stored_entropy = atof(optarg); break;
+    case 'm': min_time = atof(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  for (bi = 0; bi < nblock_sizes; bi++)
+    if (block_sizes[bi] < 1 || block_sizes[bi] > BGZF_BLOCK_SIZE) {
+      fprintf(stderr, "Invalid block size: %ld (1 to %d)\n", block_sizes[bi], BGZF_BLOCK_SIZE);
+      exit(1);
+    }
+  for (ti = 0; ti < nthreads; ti++)
+    if (threads[ti] < 1 || threads[ti] > BGZF_MAX_THREADS) {
+      fprintf(stderr, "Invalid number of threads: %ld (1 to %d)\n", threads[ti], BGZF_MAX_THREADS);
+      exit(1);
+    }
+
+  size = (size_t)(size_mb * MB);
+  if (size == 0) usage(argv[0]);
+  in = malloc(size);
+  dst = malloc(size);
+  if (!in || !dst) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  printf("{\n  \"size\": %zu,\n  \"stored_entropy\": %.2f,\n  \"min_time\": %.2f,\n  \"results\": [",
+	 size, stored_entropy, min_time);
+
+  for (corpus = strtok(corpora_arg, ","); corpus; corpus = strtok(NULL, ",")) {
+    bench_corpus(corpus, in, size);
+
+    for (li = 0; li < nlevels; li++)
+      for (bi = 0; bi < nblock_sizes; bi++)
+	for (ti = 0; ti < nthreads; ti++) {
+	  bench_job bj;
+	  bgzf_block *blocks;
+	  size_t nblocks = (size + block_sizes[bi] - 1) / block_sizes[bi];
+	  size_t out_size = 0, walked, nwalked, usize, reps;
+	  uint64_t t0, ct, dt;
+
+	  memset(&bj, 0, sizeof(bj));
+	  bj.in = in;
+	  bj.in_size = size;
+	  bj.block_size = block_sizes[bi];
+	  bj.stored_entropy = stored_entropy;
+	  for (i = 0; i < threads[ti]; i++) {
+	    bj.z[i] = libdeflate_alloc_compressor(levels[li]);
+	    bj.d[i] = libdeflate_alloc_decompressor();
+	    if (!bj.z[i] || !bj.d[i]) {
+	      fprintf(stderr, "Could not allocate a compressor for level %ld\n", levels[li]);
+	      exit(1);
+	    }
+	  }
+	  bj.stride = libdeflate_deflate_compress_bound(bj.z[0], bj.block_size) + BGZF_HEADER_LENGTH + BGZF_FOOTER_LENGTH;
+	  bj.out = malloc(nblocks * bj.stride);
+	  bj.sizes = malloc(nblocks * sizeof(size_t));
+
+	  /* compress, until it took long enough */
+	  t0 = bgzf_clock_ns();
+	  reps = 0;
+	  do {
+	    if (bench_run(&bj, threads[ti], nblocks, bench_compress_task)) {
+	      fprintf(stderr, "Compression failed\n");
+	      exit(1);
+	    }
+	    reps++;
+	  } while ((ct = bgzf_clock_ns() - t0) < min_time * 1e9);
+	  ct /= reps;
+
+	  /* pack the blocks, as the extension does */
+	  for (i = 0; (size_t)i < nblocks; i++) {
+	    memmove(bj.out + out_size, bj.out + i * bj.stride, bj.sizes[i]);
+	    out_size += bj.sizes[i];
+	  }
+
+	  walked = bgzf_walk(bj.out, out_size, &blocks, &nwalked, &usize);
+	  if (walked != out_size || nwalked != nblocks || usize != size) {
+	    fprintf(stderr, "Invalid BGZF block at offset %zu\n", walked);
+	    exit(1);
+	  }
+	  bj.blocks = blocks;
+	  bj.dst = dst;
+
+	  t0 = bgzf_clock_ns();
+	  reps = 0;
+	  do {
+	    if (bench_run(&bj, threads[ti], nblocks, bench_uncompress_task)) {
+	      fprintf(stderr, "Decompression failed\n");
+	      exit(1);
+	    }
+	    reps++;
+	  } while ((dt = bgzf_clock_ns() - t0) < min_time * 1e9);
+	  dt /= reps;
+
+	  if (memcmp(in, dst, size) != 0) {
+	    fprintf(stderr, "Round trip mismatch\n");
+	    exit(1);
+	  }
+
+	  printf("%s\n    {\"corpus\": \"%s\", \"level\": %ld, \"block_size\": %zu, \"threads\": %ld, "
+		 "\"input_bytes\": %zu, \"output_bytes\": %zu, \"ratio\": %.4f, "
+		 "\"compress_mbps\": %.1f, \"decompress_mbps\": %.1f}",
+		 (first) ? "" : ",", corpus, levels[li], bj.block_size, threads[ti],
+		 size, out_size, (double)size / out_size,
+		 size / MB / (ct / 1e9), size / MB / (dt / 1e9));
+	  fflush(stdout);
+	  first = false;
+
+	  bgzf_free(blocks);
+	  free(bj.out);
+	  free(bj.sizes);
+	  for (i = 0; i < threads[ti]; i++) {
+	    libdeflate_free_compressor(bj.z[i]);
+	    libdeflate_free_decompressor(bj.d[i]);
+	  }
+	}
+  }
+
+  printf("\n  ]\n}\n");
+  free(in);
+  free(dst);
+  return 0;
+}
@@ -11,18 +11,315 @@ LANGUAGE C STABLE PARALLEL SAFE -- IMMUTABLE -- STRICT
 ; 
 COMMENT ON FUNCTION bgzip.compress(bytea,integer,boolean) IS 'compress the given content';
 
--- CREATE FUNCTION bgzip.uncompress(content bytea)
--- RETURNS bytea
--- AS 'MODULE_PATHNAME', 'pg_bgzip_uncompress'
--- LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT
--- COST 1000; 
--- COMMENT ON FUNCTION bgzip.uncompress(bytea,integer) IS 'uncompress the given content';
+-- level as text: a number, or 'auto' (see bgzip.target_mbps). No default, so bgzip.compress(content) stays unambiguous
+CREATE FUNCTION bgzip.compress(content bytea, level text, eof boolean DEFAULT FALSE)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_text_level'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.compress(bytea,text,boolean) IS 'compress the given content, at a level picked to reach bgzip.target_mbps with ''auto''';
+
+CREATE FUNCTION bgzip.compress_agg_transfn(state internal, content bytea)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.compress_agg_transfn(state internal, content bytea, level integer)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.compress_agg_finalfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.compress_agg_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_serialfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+CREATE FUNCTION bgzip.compress_agg_deserialfn(serialized bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_deserialfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+CREATE FUNCTION bgzip.compress_agg_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_agg_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- Without ORDER BY, parallel workers make the order of the rows (as always) unspecified
+CREATE AGGREGATE bgzip.compress_agg(content bytea) (
+  SFUNC = bgzip.compress_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = bgzip.compress_agg_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE,
+  COMBINEFUNC = bgzip.compress_agg_combinefn,
+  SERIALFUNC = bgzip.compress_agg_serialfn,
+  DESERIALFUNC = bgzip.compress_agg_deserialfn,
+  PARALLEL = SAFE
+);
+COMMENT ON AGGREGATE bgzip.compress_agg(bytea) IS 'compress the concatenation of the given contents (use ORDER BY), with the EOF marker';
+
+CREATE AGGREGATE bgzip.compress_agg(content bytea, level integer) (
+  SFUNC = bgzip.compress_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = bgzip.compress_agg_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE,
+  COMBINEFUNC = bgzip.compress_agg_combinefn,
+  SERIALFUNC = bgzip.compress_agg_serialfn,
+  DESERIALFUNC = bgzip.compress_agg_deserialfn,
+  PARALLEL = SAFE
+);
+COMMENT ON AGGREGATE bgzip.compress_agg(bytea,integer) IS 'compress the concatenation of the given contents (use ORDER BY), with the EOF marker';
+
+-- Concatenation: the blocks are copied, not recompressed. Without eof, there is an EOF marker
+-- at the end when the last value ended with one
+CREATE FUNCTION bgzip.concat(VARIADIC contents bytea[])
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.concat(bytea[]) IS 'concatenate the given BGZF contents, without their inner EOF markers';
+
+CREATE FUNCTION bgzip.concat(eof boolean, VARIADIC contents bytea[])
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.concat(boolean,bytea[]) IS 'concatenate the given BGZF contents, without their EOF markers, and add one at the end if eof';
+
+CREATE FUNCTION bgzip.concat_agg_transfn(state internal, content bytea)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.concat_agg_transfn(state internal, content bytea, eof boolean)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.concat_agg_finalfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bgzip.concat_agg_serialfn(state internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_serialfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+CREATE FUNCTION bgzip.concat_agg_deserialfn(serialized bytea, dummy internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_deserialfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+CREATE FUNCTION bgzip.concat_agg_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_bgzip_concat_agg_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE bgzip.concat_agg(content bytea) (
+  SFUNC = bgzip.concat_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = bgzip.concat_agg_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE,
+  COMBINEFUNC = bgzip.concat_agg_combinefn,
+  SERIALFUNC = bgzip.concat_agg_serialfn,
+  DESERIALFUNC = bgzip.concat_agg_deserialfn,
+  PARALLEL = SAFE
+);
+COMMENT ON AGGREGATE bgzip.concat_agg(bytea) IS 'concatenate the given BGZF contents (use ORDER BY), without their inner EOF markers';
+
+CREATE AGGREGATE bgzip.concat_agg(content bytea, eof boolean) (
+  SFUNC = bgzip.concat_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = bgzip.concat_agg_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE,
+  COMBINEFUNC = bgzip.concat_agg_combinefn,
+  SERIALFUNC = bgzip.concat_agg_serialfn,
+  DESERIALFUNC = bgzip.concat_agg_deserialfn,
+  PARALLEL = SAFE
+);
+COMMENT ON AGGREGATE bgzip.concat_agg(bytea,boolean) IS 'concatenate the given BGZF contents (use ORDER BY), without their EOF markers, and add one at the end if eof';
+
+CREATE FUNCTION bgzip.append(existing bytea, data bytea, level integer DEFAULT 9)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_append'
+LANGUAGE C STABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.append(bytea,bytea,integer) IS 'append data to the given BGZF content, recompressing only its last (short) block';
+
+CREATE FUNCTION bgzip.compress_with_index(content bytea, level integer DEFAULT 9, eof boolean DEFAULT FALSE,
+                                          OUT compressed bytea, OUT index bytea)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_with_index'
+LANGUAGE C STABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.compress_with_index(bytea,integer,boolean) IS 'compress the given content, and return its GZI index too';
+
+CREATE FUNCTION bgzip.build_index(content bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_build_index'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.build_index(bytea) IS 'GZI index (htslib format) of the given content, from its block headers';
+
+-- Metadata, from the block headers and footers: nothing is inflated
+CREATE FUNCTION bgzip.uncompressed_size(content bytea)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_bgzip_uncompressed_size'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.uncompressed_size(bytea) IS 'size of the given content once uncompressed, from its block footers';
 
+CREATE FUNCTION bgzip.block_count(content bytea)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_bgzip_block_count'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.block_count(bytea) IS 'number of BGZF blocks in the given content, the EOF marker included';
 
-CREATE FUNCTION bgzip.gzip_compress(content bytea, level integer DEFAULT 9)
+CREATE FUNCTION bgzip.has_eof(content bytea)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_bgzip_has_eof'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.has_eof(bytea) IS 'whether the given content ends with the BGZF EOF marker';
+
+CREATE FUNCTION bgzip.validate(content bytea)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_bgzip_validate'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.validate(bytea) IS 'whether the given content is a sequence of well-formed BGZF blocks (the CRC32s are not checked)';
+
+CREATE FUNCTION bgzip.blocks(content bytea,
+                             OUT coffset bigint, OUT csize integer, OUT uoffset bigint, OUT usize integer,
+                             OUT crc bigint, OUT is_eof boolean)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_bgzip_blocks'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.blocks(bytea) IS 'one row per BGZF block of the given content: compressed and uncompressed offsets and sizes, and the stored CRC32';
+
+CREATE FUNCTION bgzip.uncompress(content bytea, verify boolean DEFAULT TRUE)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_uncompress'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT
+--COST 1000
+; 
+COMMENT ON FUNCTION bgzip.uncompress(bytea,boolean) IS 'uncompress the given content (and check the CRC32 of each block, unless verify is false)';
+
+CREATE FUNCTION bgzip.verify(content bytea, OUT ok boolean, OUT bad_offset bigint, OUT reason text)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_bgzip_verify'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.verify(bytea) IS 'inflate every block (without keeping the output) to check its CRC32 and ISIZE; the offset of the first bad block, if any';
+
+-- Arrays (their own names: an untyped literal would fit both bytea and bytea[]): one call, one compressor (per thread) for all the elements. NULL elements stay NULL
+CREATE FUNCTION bgzip.compress_array(content bytea[], level integer DEFAULT 9, eof boolean DEFAULT FALSE)
+RETURNS bytea[]
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_array'
+LANGUAGE C STABLE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.compress_array(bytea[],integer,boolean) IS 'compress each element of the given array';
+
+CREATE FUNCTION bgzip.gzip_compress_array(content bytea[], level integer DEFAULT 9)
+RETURNS bytea[]
+AS 'MODULE_PATHNAME', 'pg_bgzip_gzip_compress_array'
+LANGUAGE C STABLE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.gzip_compress_array(bytea[],integer) IS 'gzip compress each element of the given array';
+
+CREATE FUNCTION bgzip.uncompress_array(content bytea[], verify boolean DEFAULT TRUE)
+RETURNS bytea[]
+AS 'MODULE_PATHNAME', 'pg_bgzip_uncompress_array'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.uncompress_array(bytea[],boolean) IS 'uncompress each element of the given array';
+
+CREATE FUNCTION bgzip.read(content bytea, "offset" bigint, length bigint)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_read'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.read(bytea,bigint,bigint) IS 'uncompressed bytes [offset, offset+length), inflating only the blocks that hold them';
+
+CREATE FUNCTION bgzip.read(content bytea, "offset" bigint, length bigint, index bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_read_indexed'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.read(bytea,bigint,bigint,bytea) IS 'uncompressed bytes [offset, offset+length), using a GZI index to find the first block';
+
+CREATE FUNCTION bgzip.read_virtual(content bytea, voffset bigint, length bigint)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_bgzip_read_virtual'
+LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+COMMENT ON FUNCTION bgzip.read_virtual(bytea,bigint,bigint) IS 'length uncompressed bytes from the BGZF virtual offset (coffset<<16 | uoffset)';
+
+-- Large objects: no 1GB limit, constant memory
+CREATE FUNCTION bgzip.compress_lo(lo oid, level integer DEFAULT 9, eof boolean DEFAULT TRUE)
+RETURNS oid
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_lo'
+LANGUAGE C VOLATILE PARALLEL UNSAFE STRICT;
+COMMENT ON FUNCTION bgzip.compress_lo(oid,integer,boolean) IS 'compress the given large object into a new one, and return its oid';
+
+CREATE FUNCTION bgzip.uncompress_lo(lo oid, verify boolean DEFAULT TRUE)
+RETURNS oid
+AS 'MODULE_PATHNAME', 'pg_bgzip_uncompress_lo'
+LANGUAGE C VOLATILE PARALLEL UNSAFE STRICT;
+COMMENT ON FUNCTION bgzip.uncompress_lo(oid,boolean) IS 'uncompress the given large object into a new one, and return its oid';
+
+-- Server-side files: superusers, or members of both pg_read_server_files and pg_write_server_files
+CREATE FUNCTION bgzip.compress_file(src text, dst text, level integer DEFAULT 9, eof boolean DEFAULT TRUE)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_bgzip_compress_file'
+LANGUAGE C VOLATILE PARALLEL UNSAFE STRICT;
+COMMENT ON FUNCTION bgzip.compress_file(text,text,integer,boolean) IS 'compress the server file src into dst, and return the size of dst';
+
+CREATE FUNCTION bgzip.uncompress_file(src text, dst text, verify boolean DEFAULT TRUE)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_bgzip_uncompress_file'
+LANGUAGE C VOLATILE PARALLEL UNSAFE STRICT;
+COMMENT ON FUNCTION bgzip.uncompress_file(text,text,boolean) IS 'uncompress the server file src into dst, and return the size of dst';
+
+
+CREATE FUNCTION bgzip.gzip_compress(content bytea, level integer DEFAULT 9, single_member boolean DEFAULT FALSE)
 RETURNS bytea
 AS 'MODULE_PATHNAME', 'pg_bgzip_gzip_compress'
 LANGUAGE C STABLE PARALLEL SAFE -- IMMUTABLE -- STRICT
 --COST 1000
 ; 
-COMMENT ON FUNCTION bgzip.gzip_compress(bytea,integer) IS 'gzip-compress the given content';
+COMMENT ON FUNCTION bgzip.gzip_compress(bytea,integer,boolean) IS 'gzip-compress the given content (in several members, with bgzip.max_threads > 1, unless single_member: then no threads)';
+
+
+CREATE FUNCTION bgzip.last_compress(OUT blocks bigint, OUT stored_blocks bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_bgzip_last_compress'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+COMMENT ON FUNCTION bgzip.last_compress() IS 'blocks compressed by the last BGZF compression in this backend, and how many of them were stored (see bgzip.adaptive)';
+
+CREATE FUNCTION bgzip.compressor_cache(OUT level integer, OUT bytes bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_bgzip_compressor_cache'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+COMMENT ON FUNCTION bgzip.compressor_cache() IS 'list the compressors (and the decompressor, with a NULL level) cached in this backend';
+
+CREATE FUNCTION bgzip.compressor_cache_flush()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_bgzip_compressor_cache_flush'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+COMMENT ON FUNCTION bgzip.compressor_cache_flush() IS 'release the compressors cached in this backend, and return the amount of memory released';
+
+CREATE FUNCTION bgzip.stats(OUT function text, OUT level text,
+                            OUT calls bigint, OUT bytes_in bigint, OUT bytes_out bigint, OUT blocks bigint,
+                            OUT total_time double precision, OUT deflate_time double precision, OUT crc_time double precision)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_bgzip_stats'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.stats() IS 'calls, bytes, blocks and time (in ms) per function and compression level, across all backends (needs shared_preload_libraries)';
+
+CREATE VIEW bgzip.stats AS SELECT * FROM bgzip.stats();
+
+CREATE FUNCTION bgzip.stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_bgzip_stats_reset'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.stats_reset() IS 'reset the counters of bgzip.stats';
+REVOKE ALL ON FUNCTION bgzip.stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION bgzip.progress(OUT pid integer, OUT function text, OUT started timestamptz,
+                               OUT blocks_done bigint, OUT blocks_total bigint, OUT bytes_total bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_bgzip_progress'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION bgzip.progress() IS 'running calls, with the blocks (gzip chunks, or array elements) done so far (needs shared_preload_libraries)';
+
+CREATE VIEW bgzip.progress AS SELECT * FROM bgzip.progress();
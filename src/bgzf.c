@@ -0,0 +1,402 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/bgzf.c
+ *
+ * BGZF core, independent of Postgres: see bgzf.h.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "bgzf.h"
+
+const uint8_t bgzf_magic[19] =    "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\0\0";
+const uint8_t bgzf_eof_marker[BGZF_EOF_LENGTH] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+/*
+ * Memory
+ */
+static void *(*bgzf_malloc_func)(size_t) = malloc;
+static void (*bgzf_free_func)(void *) = free;
+
+void
+bgzf_set_memory_allocator(void *(*malloc_func)(size_t), void (*free_func)(void *))
+{
+  bgzf_malloc_func = malloc_func;
+  bgzf_free_func = free_func;
+}
+
+void *
+bgzf_malloc(size_t size)
+{
+  return bgzf_malloc_func(size);
+}
+
+void
+bgzf_free(void *ptr)
+{
+  bgzf_free_func(ptr);
+}
+
+/*
+ * Timing
+ */
+bool bgzf_timing = false;
+atomic_uint_fast64_t bgzf_deflate_ns;
+atomic_uint_fast64_t bgzf_crc_ns;
+
+uint64_t
+bgzf_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Block walker
+ *
+ * BGZF blocks are found by jumping from one header to the next, using the block size
+ * stored in the BC extra field. The CRC32 and ISIZE are read from the footer.
+ * No data is inflated.
+ */
+int
+bgzf_parse_header(const uint8_t *header, size_t *csize)
+{
+  /* same checks as htslib */
+  if (header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0 ||
+      unpackInt16(&header[10]) != 6 ||
+      header[12] != 'B' || header[13] != 'C' || unpackInt16(&header[14]) != 2)
+    return -1;
+
+  *csize = (size_t)unpackInt16(&header[16]) + 1;
+  if (*csize < BGZF_HEADER_LENGTH + BGZF_FOOTER_LENGTH)
+    return -1;
+
+  return 0;
+}
+
+int
+bgzf_parse_footer(const uint8_t *footer, bgzf_block *b)
+{
+  b->crc = unpackInt32(&footer[0]);
+  b->usize = unpackInt32(&footer[4]);
+  return (b->usize > BGZF_MAX_BLOCK_SIZE) ? -1 : 0;
+}
+
+int
+bgzf_parse_block(const uint8_t *src, size_t slen, bgzf_block *b)
+{
+  if (slen < BGZF_HEADER_LENGTH + BGZF_FOOTER_LENGTH)
+    return -1;
+
+  if (bgzf_parse_header(src, &b->csize) || b->csize > slen)
+    return -1;
+
+  return bgzf_parse_footer(&src[b->csize - BGZF_FOOTER_LENGTH], b);
+}
+
+/* Two passes over the headers: one to count the blocks, one to fill the array */
+size_t
+bgzf_walk(const uint8_t *src, size_t slen,
+	  bgzf_block **blocks, size_t *nblocks, size_t *usize)
+{
+  size_t coffset = 0, uoffset = 0, n = 0, i;
+  bgzf_block b, *a;
+
+  while (coffset < slen && bgzf_parse_block(src + coffset, slen - coffset, &b) == 0) {
+    coffset += b.csize;
+    n++;
+  }
+
+  *blocks = NULL;
+  *nblocks = 0;
+  *usize = 0;
+  if (n == 0)
+    return 0;
+
+  a = (bgzf_block *)bgzf_malloc(n * sizeof(bgzf_block));
+  if (!a)
+    return 0;
+
+  for (coffset = 0, i = 0; i < n; i++) {
+    bgzf_parse_block(src + coffset, slen - coffset, &a[i]); /* already checked */
+    a[i].coffset = coffset;
+    a[i].uoffset = uoffset;
+    coffset += a[i].csize;
+    uoffset += a[i].usize;
+  }
+
+  *blocks = a;
+  *nblocks = n;
+  *usize = uoffset;
+  return coffset;
+}
+
+/*
+ * Block codec
+ */
+size_t
+bgzf_block_bound(struct libdeflate_compressor *z)
+{
+  return libdeflate_deflate_compress_bound(z, BGZF_BLOCK_SIZE) + BGZF_HEADER_LENGTH + BGZF_FOOTER_LENGTH;
+}
+
+/*
+ * An incompressible block is stored as is, in a single stored deflate block
+ * (BGZF_BLOCK_SIZE fits its 16-bit length)
+ */
+int
+bgzf_compress_block(struct libdeflate_compressor *z,
+		    uint8_t *dst, size_t *dlen,
+		    const uint8_t *src, size_t slen,
+		    double stored_entropy)
+//__attribute__((non-null(1,2,3,4)))
+{
+    size_t clen;
+    uint32_t crc;
+    int stored = 0;
+    uint64_t t0 = 0, t1;
+
+    if (slen == 0) { // EOF block
+        if (*dlen < BGZF_EOF_LENGTH) return -1;
+        memcpy(dst, bgzf_eof_marker, BGZF_EOF_LENGTH);
+        *dlen = BGZF_EOF_LENGTH;
+        return 0;
+    }
+
+    if (bgzf_timing) t0 = bgzf_clock_ns();
+
+    if (slen <= 0xffff && bgzf_is_incompressible(src, slen, stored_entropy)) {
+      uint8_t *p = dst + BGZF_HEADER_LENGTH;
+
+      clen = slen + 5;
+      if (clen > *dlen - BGZF_HEADER_LENGTH - BGZF_FOOTER_LENGTH)
+	return -1;
+      p[0] = 1; // BFINAL, and BTYPE 00: stored
+      packInt16(&p[1], slen);
+      packInt16(&p[3], ~slen);
+      memcpy(p + 5, src, slen);
+      stored = 1;
+    }
+    else {
+      // Raw deflate
+      clen = libdeflate_deflate_compress(z, (const void *)src, slen,
+					 (void *)(dst + BGZF_HEADER_LENGTH),
+					 *dlen - BGZF_HEADER_LENGTH - BGZF_FOOTER_LENGTH);
+
+      if (clen <= 0) /* no logging here: we might be in a thread */
+	return -1;
+    }
+
+    *dlen = clen + BGZF_HEADER_LENGTH + BGZF_FOOTER_LENGTH;
+
+    // write the header
+    memcpy(dst, bgzf_magic, BGZF_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
+    packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
+
+    if (t0) {
+      t1 = bgzf_clock_ns();
+      atomic_fetch_add(&bgzf_deflate_ns, t1 - t0);
+      t0 = t1;
+    }
+
+    // write the footer
+    crc = libdeflate_crc32(0, src, slen);
+    if (t0) atomic_fetch_add(&bgzf_crc_ns, bgzf_clock_ns() - t0);
+    packInt32((uint8_t*)&dst[*dlen - 8], crc);  // CRC
+    packInt32((uint8_t*)&dst[*dlen - 4], slen); // ISIZE
+    return stored;
+}
+
+int
+bgzf_uncompress_block(struct libdeflate_decompressor *d,
+		      uint8_t *dst, const uint8_t *src, const bgzf_block *b,
+		      bool verify)
+{
+  uint64_t t0 = (bgzf_timing) ? bgzf_clock_ns() : 0, t1;
+  enum libdeflate_result rc;
+  uint32_t crc;
+
+  /* no actual_out_nbytes_ret: anything but exactly usize bytes is an error */
+  rc = libdeflate_deflate_decompress(d, src + BGZF_HEADER_LENGTH,
+				     b->csize - BGZF_HEADER_LENGTH - BGZF_FOOTER_LENGTH,
+				     dst, b->usize, NULL);
+  if (t0) {
+    t1 = bgzf_clock_ns();
+    atomic_fetch_add(&bgzf_deflate_ns, t1 - t0);
+    t0 = t1;
+  }
+  if (rc == LIBDEFLATE_SHORT_OUTPUT || rc == LIBDEFLATE_INSUFFICIENT_SPACE)
+    return BGZF_BAD_SIZE;
+  if (rc != LIBDEFLATE_SUCCESS)
+    return BGZF_BAD_DATA;
+
+  if (!verify)
+    return 0;
+
+  crc = libdeflate_crc32(0, dst, b->usize);
+  if (t0) atomic_fetch_add(&bgzf_crc_ns, bgzf_clock_ns() - t0);
+  return (crc == b->crc) ? 0 : BGZF_BAD_CRC;
+}
+
+/*
+ * Incompressibility
+ *
+ * Already-compressed or encrypted content has an entropy of nearly 8 bits per byte,
+ * and deflate spends its time on it for nothing. The byte histogram of a sample
+ * (spread over the content) is enough to tell, and costs next to nothing compared to deflate.
+ */
+#define BGZF_ENTROPY_SAMPLE (64 * 1024)
+#define BGZF_ENTROPY_SLICES 16
+
+double
+bgzf_entropy(const uint8_t *src, size_t slen)
+{
+  uint32_t hist[256];
+  size_t n = 0, i, s, step, len;
+  double h = 0.0;
+
+  if (slen == 0)
+    return 0.0;
+
+  memset(hist, 0, sizeof(hist));
+
+  if (slen <= BGZF_ENTROPY_SAMPLE) {
+    for (i = 0; i < slen; i++) hist[src[i]]++;
+    n = slen;
+  } else {
+    len = BGZF_ENTROPY_SAMPLE / BGZF_ENTROPY_SLICES;
+    step = (slen - len) / (BGZF_ENTROPY_SLICES - 1);
+    for (s = 0; s < BGZF_ENTROPY_SLICES; s++) {
+      const uint8_t *p = src + s * step;
+      for (i = 0; i < len; i++) hist[p[i]]++;
+    }
+    n = len * BGZF_ENTROPY_SLICES;
+  }
+
+  for (i = 0; i < 256; i++) {
+    if (hist[i]) {
+      double p = (double)hist[i] / n;
+      h -= p * log2(p);
+    }
+  }
+  return h;
+}
+
+/*
+ * Thread pool
+ */
+static void
+bgzf_job_run(bgzf_job *job, int worker)
+{
+  size_t task;
+
+  while (!atomic_load(&job->abort)){
+
+    task = atomic_fetch_add(&job->next, 1);
+    if (task >= job->ntasks)
+      break;
+
+    if (job->fn(job->arg, task, worker)) {
+      size_t prev = atomic_load(&job->failed_task);
+      while (task < prev && !atomic_compare_exchange_weak(&job->failed_task, &prev, task));
+      atomic_store(&job->abort, true);
+    }
+    atomic_fetch_add(&job->completed, 1);
+
+    if (worker == 0 && job->poll && job->poll(job->poll_arg, atomic_load(&job->completed))) {
+      atomic_store(&job->interrupted, true);
+      atomic_store(&job->abort, true);
+    }
+  }
+}
+
+static void *
+bgzf_job_thread(void *arg)
+{
+  bgzf_worker *w = (bgzf_worker *)arg;
+  bgzf_job_run(w->job, w->id);
+  return NULL;
+}
+
+static int
+bgzf_job_spawn(bgzf_job *job, int nthreads)
+{
+  sigset_t all, old;
+  int i;
+
+  job->nthreads = 0;
+  if (nthreads <= 1) return 0;
+
+  /* threads inherit the signal mask */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for (i = 1; i < nthreads; i++) {
+    bgzf_worker *w = &job->workers[job->nthreads];
+    w->job = job;
+    w->id = i;
+    if (pthread_create(&job->threads[job->nthreads], NULL, bgzf_job_thread, w))
+      break; /* we'll do with fewer threads */
+    job->nthreads++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return job->nthreads;
+}
+
+int
+bgzf_job_start(bgzf_job *job, int nthreads, size_t ntasks, bgzf_task_fn fn, void *arg,
+	       bgzf_poll_fn poll, void *poll_arg)
+{
+  job->fn = fn;
+  job->arg = arg;
+  job->poll = poll;
+  job->poll_arg = poll_arg;
+  job->ntasks = ntasks;
+  atomic_init(&job->next, 0);
+  atomic_init(&job->failed_task, SIZE_MAX);
+  atomic_init(&job->abort, false);
+  atomic_init(&job->interrupted, false);
+  atomic_init(&job->completed, 0);
+
+  if (nthreads > BGZF_MAX_THREADS) nthreads = BGZF_MAX_THREADS;
+  job->requested = nthreads;
+  return bgzf_job_spawn(job, nthreads);
+}
+
+size_t
+bgzf_job_wait(bgzf_job *job)
+{
+  bgzf_job_run(job, 0);
+  bgzf_job_abort(job); /* no task left to hand out by now: this only joins the threads */
+  return atomic_load(&job->failed_task);
+}
+
+bool
+bgzf_job_resume(bgzf_job *job)
+{
+  if (atomic_load(&job->failed_task) != SIZE_MAX || atomic_load(&job->next) >= job->ntasks)
+    return false;
+
+  atomic_store(&job->interrupted, false);
+  atomic_store(&job->abort, false);
+  bgzf_job_spawn(job, job->requested);
+  return true;
+}
+
+void
+bgzf_job_abort(bgzf_job *job)
+{
+  int i;
+
+  atomic_store(&job->abort, true);
+  for (i = 0; i < job->nthreads; i++)
+    pthread_join(job->threads[i], NULL);
+  job->nthreads = 0;
+}
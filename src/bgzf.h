@@ -0,0 +1,257 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/bgzf.h
+ *
+ * BGZF core, independent of Postgres: block codec, header and footer,
+ * block walker, incompressibility, CRC32 combination, and thread pool.
+ * https://samtools.github.io/hts-specs/SAMv1.pdf#subsection.4.1
+ *
+ * Used by the extension (src/pg.c), and by the native benchmark (bench/).
+ * Nothing here calls into Postgres, allocates behind the caller's back
+ * (see bgzf_set_memory_allocator), or logs.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <libdeflate.h>
+
+#define BGZF_BLOCK_SIZE     0xff00 // make sure compressBound(BGZF_BLOCK_SIZE) < BGZF_MAX_BLOCK_SIZE
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_HEADER_LENGTH 18
+#define BGZF_FOOTER_LENGTH 8
+#define BGZF_EOF_LENGTH 28
+
+#define BGZF_MAX_THREADS 64
+
+/* BGZIP header (specialized from RFC 1952; little endian):
+ +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+ | 31|139|  8|  4|              0|  0|255|      6| 66| 67|      2|BLK_LEN|
+ +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+  BGZIP extension:
+                ^                              ^   ^   ^
+                |                              |   |   |
+               FLG.EXTRA                     XLEN  B   C
+
+  BGZIP format is compatible with GZIP. It limits the size of each compressed
+  block to 2^16 bytes and adds and an extra "BC" field in the gzip header which
+  records the size.
+*/
+extern const uint8_t bgzf_magic[19];
+extern const uint8_t bgzf_eof_marker[BGZF_EOF_LENGTH];
+
+static inline void packInt16(uint8_t *buffer, uint16_t value)
+{
+  uint32_t value_le = htole16(value);
+  memcpy(buffer, &value_le, 2);
+  /*
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+  */
+}
+
+static inline void packInt32(uint8_t *buffer, uint32_t value)
+{
+  uint32_t value_le = htole32(value);
+  memcpy(buffer, &value_le, 4);
+  /*
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+    buffer[2] = value >> 16;
+    buffer[3] = value >> 24;
+  */
+}
+
+static inline void packInt64(uint8_t *buffer, uint64_t value)
+{
+  uint64_t value_le = htole64(value);
+  memcpy(buffer, &value_le, 8);
+}
+
+static inline uint16_t unpackInt16(const uint8_t *buffer)
+{
+  uint16_t value;
+  memcpy(&value, buffer, 2);
+  return le16toh(value);
+}
+
+static inline uint32_t unpackInt32(const uint8_t *buffer)
+{
+  uint32_t value;
+  memcpy(&value, buffer, 4);
+  return le32toh(value);
+}
+
+static inline uint64_t unpackInt64(const uint8_t *buffer)
+{
+  uint64_t value;
+  memcpy(&value, buffer, 8);
+  return le64toh(value);
+}
+
+/*
+ * Memory
+ *
+ * Only bgzf_walk allocates. malloc and free by default; the extension plugs palloc in.
+ */
+void bgzf_set_memory_allocator(void *(*malloc_func)(size_t), void (*free_func)(void *));
+void *bgzf_malloc(size_t size);
+void bgzf_free(void *ptr);
+
+/*
+ * Timing
+ *
+ * When bgzf_timing is set, the block codecs add the nanoseconds they spend (in)flating
+ * and computing CRC32s to these process-wide counters, from whichever thread.
+ */
+extern bool bgzf_timing;
+extern atomic_uint_fast64_t bgzf_deflate_ns;
+extern atomic_uint_fast64_t bgzf_crc_ns;
+
+uint64_t bgzf_clock_ns(void);
+
+/*
+ * Blocks
+ */
+typedef struct bgzf_block {
+  size_t coffset;  /* offset of the block in the compressed content */
+  size_t csize;    /* size of the block, header and footer included (BSIZE + 1) */
+  size_t uoffset;  /* offset of its data in the uncompressed content */
+  uint32_t usize;  /* ISIZE */
+  uint32_t crc;    /* CRC32 of the uncompressed data */
+} bgzf_block;
+
+/* Parse the block at the start of src. Returns 0, or -1 if it is not a (complete) BGZF block */
+int bgzf_parse_block(const uint8_t *src, size_t slen, bgzf_block *b);
+
+/*
+ * The same, in two steps, for callers that only have the header and the footer at hand:
+ * the header (BGZF_HEADER_LENGTH bytes) gives the size of the block, then its footer
+ * (the last BGZF_FOOTER_LENGTH bytes) gives b->crc and b->usize. Each returns 0, or -1.
+ */
+int bgzf_parse_header(const uint8_t *header, size_t *csize);
+int bgzf_parse_footer(const uint8_t *footer, bgzf_block *b);
+
+/* An empty block: the EOF marker is one */
+static inline bool
+bgzf_is_eof_block(const bgzf_block *b)
+{
+  return b->usize == 0;
+}
+
+/*
+ * Walk all the blocks of src, and return them in an array from bgzf_malloc
+ * (NULL if that failed, or if there is no block).
+ * Returns how many bytes were walked: if that is less than slen,
+ * there is no valid block at that offset.
+ */
+size_t bgzf_walk(const uint8_t *src, size_t slen,
+		 bgzf_block **blocks, size_t *nblocks, size_t *usize);
+
+/* Largest BGZF block that a full input block can compress into */
+size_t bgzf_block_bound(struct libdeflate_compressor *z);
+
+/*
+ * Compress one block (at most BGZF_BLOCK_SIZE bytes; none for an EOF block) into dst,
+ * which has room for *dlen bytes. *dlen is then the size of the block.
+ * Returns -1 on error, 0 when deflated, and 1 when stored: a block with an entropy of
+ * stored_entropy bits per byte or more is stored without trying to deflate it
+ * (8 or more: never).
+ */
+int bgzf_compress_block(struct libdeflate_compressor *z,
+			uint8_t *dst, size_t *dlen,
+			const uint8_t *src, size_t slen,
+			double stored_entropy);
+
+/* Inflate one block into dst, which has room for exactly b->usize bytes */
+#define BGZF_BAD_DATA -1
+#define BGZF_BAD_CRC  -2
+#define BGZF_BAD_SIZE -3 /* inflates to more or fewer bytes than ISIZE */
+int bgzf_uncompress_block(struct libdeflate_decompressor *d,
+			  uint8_t *dst, const uint8_t *src, const bgzf_block *b,
+			  bool verify);
+
+/*
+ * Incompressibility: Shannon entropy (in bits per byte) of the byte histogram
+ * of a sample spread over src
+ */
+double bgzf_entropy(const uint8_t *src, size_t slen);
+
+static inline bool
+bgzf_is_incompressible(const uint8_t *src, size_t slen, double stored_entropy)
+{
+  return stored_entropy < 8.0 && bgzf_entropy(src, slen) >= stored_entropy;
+}
+
+/*
+ * Thread pool
+ *
+ * A job is a number of independent tasks (usually one per BGZF block), that
+ * the calling thread (worker 0) and (nthreads - 1) extra threads pick in order.
+ * The extra threads block all signals, so that signal handlers keep running
+ * in the calling thread only.
+ *
+ * A task returns non-zero on failure. The job then stops handing out tasks, and
+ * remembers the lowest failed task number, for the caller to report once all
+ * threads are joined.
+ *
+ * Between its own tasks, the calling thread calls poll (if set) with the number of tasks
+ * completed so far. A non-zero return stops the job, as an interruption: the threads
+ * are joined, and the caller may bgzf_job_resume it.
+ */
+typedef int (*bgzf_task_fn)(void *arg, size_t task, int worker);
+typedef int (*bgzf_poll_fn)(void *arg, size_t completed);
+
+typedef struct bgzf_job bgzf_job;
+
+typedef struct bgzf_worker {
+  bgzf_job *job;
+  int id;
+} bgzf_worker;
+
+struct bgzf_job {
+  bgzf_task_fn fn;
+  void *arg;
+  bgzf_poll_fn poll;
+  void *poll_arg;
+  size_t ntasks;
+  atomic_size_t next;        /* next task to hand out */
+  atomic_size_t failed_task; /* lowest failed task, or SIZE_MAX */
+  atomic_bool abort;
+  atomic_bool interrupted;   /* stopped by poll */
+  atomic_size_t completed;   /* tasks done */
+  int requested;             /* threads asked for, caller included */
+  int nthreads;              /* extra threads actually started */
+  pthread_t threads[BGZF_MAX_THREADS];
+  bgzf_worker workers[BGZF_MAX_THREADS];
+};
+
+/* Start (nthreads - 1) extra threads on the job. Returns how many were started */
+int bgzf_job_start(bgzf_job *job, int nthreads, size_t ntasks, bgzf_task_fn fn, void *arg,
+		   bgzf_poll_fn poll, void *poll_arg);
+
+/* Work on the job from the calling thread too, and join the threads. Returns the lowest failed task, or SIZE_MAX */
+size_t bgzf_job_wait(bgzf_job *job);
+
+static inline bool
+bgzf_job_interrupted(bgzf_job *job)
+{
+  return atomic_load(&job->interrupted);
+}
+
+/* After an interruption: restart the threads on the tasks left. Returns false if there is nothing to resume */
+bool bgzf_job_resume(bgzf_job *job);
+
+/* Stop handing out tasks, and join the threads. For error paths: safe to call on a finished job */
+void bgzf_job_abort(bgzf_job *job);
+
+#endif /* BGZF_H */
@@ -19,14 +19,45 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h>
 
 #include "postgres.h"
 #include "fmgr.h"
 #include "utils/elog.h"
 #include "funcapi.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#include "utils/guc.h"
+#include "access/detoast.h"
+#include "libpq/be-fsstubs.h"
+#include "libpq/libpq-fs.h"
+#include "miscadmin.h"
+#include "catalog/pg_authid.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
+#include "catalog/pg_type.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "storage/lwlock.h"
+#include "port/atomics.h"
+#include "access/xact.h"
+#if PG_VERSION_NUM < 170000
+#include "storage/backendid.h"
+#endif
+#include "utils/timestamp.h"
 
 #include <libdeflate.h>
 
+#include "bgzf.h"
+
 /* logging */
 #define F(fmt, ...)  elog(FATAL,  "============ " fmt, ##__VA_ARGS__)
 #define E(fmt, ...)  elog(ERROR,  "============ " fmt, ##__VA_ARGS__)
@@ -41,235 +72,3576 @@
 
 PG_MODULE_MAGIC;
 
-#define BGZIP_BLOCK_SIZE     0xff00 // make sure compressBound(BGZIP_BLOCK_SIZE) < BGZIP_MAX_BLOCK_SIZE
-#define BGZIP_MAX_BLOCK_SIZE 0x10000
-#define BLOCK_HEADER_LENGTH 18
-#define BLOCK_FOOTER_LENGTH 8
-
-/* BGZIP header (specialized from RFC 1952; little endian):
- +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
- | 31|139|  8|  4|              0|  0|255|      6| 66| 67|      2|BLK_LEN|
- +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-  BGZIP extension:
-                ^                              ^   ^   ^
-                |                              |   |   |
-               FLG.EXTRA                     XLEN  B   C
-
-  BGZIP format is compatible with GZIP. It limits the size of each compressed
-  block to 2^16 bytes and adds and an extra "BC" field in the gzip header which
-  records the size.
-*/
-static const uint8_t g_magic[19] =    "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\0\0";
-static const uint8_t eof_marker[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
-
-static inline void packInt16(uint8_t *buffer, uint16_t value)
-{
-  uint32_t value_le = htole16(value);
-  memcpy(buffer, &value_le, 2);
-  /*
-    buffer[0] = value;
-    buffer[1] = value >> 8;
-  */
+/* GUCs */
+static int bgzip_max_threads = 1;
+static double bgzip_stored_entropy = 7.95;
+static bool bgzip_adaptive = false;
+static double bgzip_target_mbps = 100.0;
+
+/* see Shared statistics */
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static void bgzip_shmem_request(void);
+static void bgzip_shmem_startup(void);
+static Size bgzip_progress_size(void);
+static void bgzip_progress_init(void);
+
+/* see Thread pool */
+static void *bgzip_job_alloc(size_t size);
+
+void _PG_init(void);
+void
+_PG_init(void)
+{
+  DefineCustomIntVariable("bgzip.max_threads",
+			  "Maximum number of threads used to (de)compress one value.",
+			  "1 means no extra thread: everything runs in the backend itself.",
+			  &bgzip_max_threads,
+			  1, 1, BGZF_MAX_THREADS,
+			  PGC_USERSET, 0,
+			  NULL, NULL, NULL);
+
+  DefineCustomRealVariable("bgzip.stored_entropy",
+			   "Entropy (in bits per byte) from which content is stored instead of deflated.",
+			   "Measured on a sample of the content. 8 disables it.",
+			   &bgzip_stored_entropy,
+			   7.95, 0.0, 8.0,
+			   PGC_USERSET, 0,
+			   NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("bgzip.adaptive",
+			   "Store the BGZF blocks that would not compress, instead of deflating them.",
+			   "Each block is sampled, and stored if its entropy is above bgzip.stored_entropy.",
+			   &bgzip_adaptive,
+			   false,
+			   PGC_USERSET, 0,
+			   NULL, NULL, NULL);
+
+  DefineCustomRealVariable("bgzip.target_mbps",
+			   "Throughput (in MB/s) that the \"auto\" compression level aims for.",
+			   "The highest level that compressed at least that fast recently is used.",
+			   &bgzip_target_mbps,
+			   100.0, 0.1, 100000.0,
+			   PGC_USERSET, 0,
+			   NULL, NULL, NULL);
+
+  MarkGUCPrefixReserved("bgzip");
+
+  /* The arrays of bgzf_walk go in the memory context of the call, like the rest */
+  bgzf_set_memory_allocator(bgzip_job_alloc, pfree);
+
+  /* Shared statistics, only when preloaded */
+  if (process_shared_preload_libraries_in_progress) {
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = bgzip_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = bgzip_shmem_startup;
+  }
+}
+
+/*
+ * Compressor cache
+ *
+ * A libdeflate compressor is a few hundred KB of state (more at the higher levels),
+ * so we keep one per compression level for the lifetime of the backend, instead of
+ * allocating (and freeing) one per block.
+ * The compressors live in their own memory context, child of TopMemoryContext.
+ * Deleting or resetting that context (see bgzip.compressor_cache_flush()) releases
+ * them all, and a reset callback forgets the cached pointers.
+ */
+#define BGZIP_MIN_LEVEL 0
+#define BGZIP_MAX_LEVEL 12 /* libdeflate goes further than zlib's 9 */
+#define BGZIP_DEFAULT_LEVEL 6 /* libdeflate's default */
+#define BGZIP_AUTO_LEVEL -2 /* picked per batch, see bgzip_auto_level() */
+
+static MemoryContext bgzip_cache_context = NULL;
+static MemoryContextCallback bgzip_cache_callback;
+static struct libdeflate_compressor *bgzip_compressors[BGZIP_MAX_LEVEL + 1];
+static Size bgzip_compressors_size[BGZIP_MAX_LEVEL + 1];
+static Size bgzip_cache_allocated = 0; /* bytes allocated by the compressor being created */
+
+static void *bgzip_cache_alloc(size_t size)
+{
+  bgzip_cache_allocated += size;
+  return MemoryContextAlloc(bgzip_cache_context, size); /* no need to zero it */
 }
 
-static inline void packInt32(uint8_t *buffer, uint32_t value)
+static void bgzip_cache_free(void *ptr)
 {
-  uint32_t value_le = htole32(value);
-  memcpy(buffer, &value_le, 4);
-  /*
-    buffer[0] = value;
-    buffer[1] = value >> 8;
-    buffer[2] = value >> 16;
-    buffer[3] = value >> 24;
-  */
+  pfree(ptr);
 }
 
 static struct libdeflate_options libdeflate_options = {
   .sizeof_options = sizeof(struct libdeflate_options),
-  .malloc_func = palloc0,
-  .free_func = pfree,
+  .malloc_func = bgzip_cache_alloc,
+  .free_func = bgzip_cache_free,
 };
 
-static int
-bgzip_compress_block(uint8_t *dst, size_t *dlen,
-		     const uint8_t *src, size_t slen,
-		     int level)
-//__attribute__((non-null(1,2,3,4)))
-{
-    struct libdeflate_options options;
-    struct libdeflate_compressor *z = NULL;
-    size_t clen;
-    uint32_t crc;
-
-    if (slen == 0) { // EOF block
-        if (*dlen < 28) return -1;
-        //memcpy(dst, "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
-        memcpy(dst, g_magic, 16); // not the last bytes
-        memcpy(dst+16, "\033\0\3\0\0\0\0\0\0\0\0\0", 12);
-        *dlen = 28;
-        return 0;
-    }
+/* Decompressors are much smaller, and the same for all levels */
+static struct libdeflate_decompressor *bgzip_decompressor = NULL;
+static Size bgzip_decompressor_size = 0;
+
+static void bgzip_cache_reset(void *arg)
+{
+  /* The memory is gone: forget about it */
+  memset(bgzip_compressors, 0, sizeof(bgzip_compressors));
+  memset(bgzip_compressors_size, 0, sizeof(bgzip_compressors_size));
+  bgzip_decompressor = NULL;
+  bgzip_decompressor_size = 0;
+  bgzip_cache_context = NULL;
+}
+
+static void
+bgzip_cache_init(void)
+{
+  if(bgzip_cache_context)
+    return;
 
-    memset(&options, 0, sizeof(options));
-    options.sizeof_options = sizeof(options);
-    options.malloc_func = palloc0;
-    options.free_func = pfree;
+  bgzip_cache_context = AllocSetContextCreate(TopMemoryContext,
+					      "bgzip compressors",
+					      ALLOCSET_DEFAULT_SIZES);
+  bgzip_cache_callback.func = bgzip_cache_reset;
+  bgzip_cache_callback.arg = NULL;
+  MemoryContextRegisterResetCallback(bgzip_cache_context, &bgzip_cache_callback);
+}
+
+static struct libdeflate_compressor *
+bgzip_get_compressor(int level)
+{
+  struct libdeflate_compressor *z;
 
-    z = libdeflate_alloc_compressor_ex(level, &options);
-    if (!z) return -1;
+  if(level == -1) level = BGZIP_DEFAULT_LEVEL;
+  Assert(level >= BGZIP_MIN_LEVEL && level <= BGZIP_MAX_LEVEL);
 
-    // Raw deflate
-    clen = libdeflate_deflate_compress(z, (const void *)src, slen,
-				       (void *)(dst + BLOCK_HEADER_LENGTH),
-				       *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH);
+  if(bgzip_compressors[level])
+    return bgzip_compressors[level];
 
-    if (clen <= 0) {
-      W("libdeflate_deflate_compress failed");
-      libdeflate_free_compressor(z);
-      return -1;
+  bgzip_cache_init();
+
+  bgzip_cache_allocated = 0;
+  z = libdeflate_alloc_compressor_ex(level, &libdeflate_options);
+  if (!z)
+    E("Could not allocate a compressor for level %d", level);
+
+  D2("Caching a compressor for level %d: %zu bytes", level, bgzip_cache_allocated);
+  bgzip_compressors[level] = z;
+  bgzip_compressors_size[level] = bgzip_cache_allocated;
+  return z;
+}
+
+static struct libdeflate_decompressor *
+bgzip_get_decompressor(void)
+{
+  if(bgzip_decompressor)
+    return bgzip_decompressor;
+
+  bgzip_cache_init();
+
+  bgzip_cache_allocated = 0;
+  bgzip_decompressor = libdeflate_alloc_decompressor_ex(&libdeflate_options);
+  if (!bgzip_decompressor)
+    E("Could not allocate a decompressor");
+
+  D2("Caching a decompressor: %zu bytes", bgzip_cache_allocated);
+  bgzip_decompressor_size = bgzip_cache_allocated;
+  return bgzip_decompressor;
+}
+
+/*
+ * Shared statistics
+ *
+ * With pg_bgzip in shared_preload_libraries, a small shared memory area counts, per
+ * function and compression level: the calls, the bytes in and out, the blocks, the
+ * elapsed time, and the time spent (in)flating and computing CRC32s (summed over the
+ * threads, so it can exceed the elapsed time).
+ * The counters are atomics, added to once per successful call. Without the preload,
+ * nothing is counted (nor timed), and bgzip.stats is empty.
+ */
+typedef enum bgzip_stats_fn {
+  BGZIP_FN_COMPRESS,
+  BGZIP_FN_GZIP_COMPRESS,
+  BGZIP_FN_UNCOMPRESS,
+  BGZIP_FN_COMPRESS_LO,
+  BGZIP_FN_UNCOMPRESS_LO,
+  BGZIP_FN_COMPRESS_FILE,
+  BGZIP_FN_UNCOMPRESS_FILE,
+  BGZIP_FN_VERIFY,
+  BGZIP_STATS_FNS
+} bgzip_stats_fn;
+
+static const char *const bgzip_stats_fn_names[BGZIP_STATS_FNS] = {
+  "compress", "gzip_compress", "uncompress",
+  "compress_lo", "uncompress_lo", "compress_file", "uncompress_file",
+  "verify",
+};
+
+#define BGZIP_NO_LEVEL -3                       /* for the functions without a level */
+#define BGZIP_STATS_AUTO (BGZIP_MAX_LEVEL + 1)  /* slot of the "auto" level */
+#define BGZIP_STATS_NONE (BGZIP_MAX_LEVEL + 2)  /* slot of BGZIP_NO_LEVEL */
+#define BGZIP_STATS_SLOTS (BGZIP_MAX_LEVEL + 3)
+
+typedef struct bgzip_stats_entry {
+  pg_atomic_uint64 calls;
+  pg_atomic_uint64 bytes_in;
+  pg_atomic_uint64 bytes_out;
+  pg_atomic_uint64 blocks;
+  pg_atomic_uint64 time_ns;
+  pg_atomic_uint64 deflate_ns;
+  pg_atomic_uint64 crc_ns;
+} bgzip_stats_entry;
+
+typedef struct bgzip_shared_stats {
+  bgzip_stats_entry entries[BGZIP_STATS_FNS][BGZIP_STATS_SLOTS];
+} bgzip_shared_stats;
+
+static bgzip_shared_stats *bgzip_stats = NULL;
+
+static void
+bgzip_shmem_request(void)
+{
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+
+  RequestAddinShmemSpace(sizeof(bgzip_shared_stats));
+  RequestAddinShmemSpace(bgzip_progress_size());
+}
+
+static void
+bgzip_shmem_startup(void)
+{
+  bool found;
+  int fn, slot;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  bgzip_stats = (bgzip_shared_stats *)ShmemInitStruct("pg_bgzip stats", sizeof(bgzip_shared_stats), &found);
+  bgzf_timing = true; /* the block codecs time themselves, for the stats */
+  if (!found) {
+    for (fn = 0; fn < BGZIP_STATS_FNS; fn++)
+      for (slot = 0; slot < BGZIP_STATS_SLOTS; slot++) {
+	bgzip_stats_entry *e = &bgzip_stats->entries[fn][slot];
+	pg_atomic_init_u64(&e->calls, 0);
+	pg_atomic_init_u64(&e->bytes_in, 0);
+	pg_atomic_init_u64(&e->bytes_out, 0);
+	pg_atomic_init_u64(&e->blocks, 0);
+	pg_atomic_init_u64(&e->time_ns, 0);
+	pg_atomic_init_u64(&e->deflate_ns, 0);
+	pg_atomic_init_u64(&e->crc_ns, 0);
+      }
+  }
+  bgzip_progress_init();
+  LWLockRelease(AddinShmemInitLock);
+}
+
+typedef struct bgzip_stats_call {
+  bgzip_stats_fn fn;
+  int slot;
+  uint64 start;
+  uint64 deflate_ns;  /* bgzf_deflate_ns at the start */
+  uint64 crc_ns;      /* bgzf_crc_ns at the start */
+} bgzip_stats_call;
+
+static void
+bgzip_stats_begin(bgzip_stats_call *c, bgzip_stats_fn fn, int level)
+{
+  if (!bgzip_stats)
+    return;
+
+  c->fn = fn;
+  if (level == BGZIP_NO_LEVEL)
+    c->slot = BGZIP_STATS_NONE;
+  else if (level == BGZIP_AUTO_LEVEL)
+    c->slot = BGZIP_STATS_AUTO;
+  else
+    c->slot = (level == -1) ? BGZIP_DEFAULT_LEVEL : level;
+
+  c->deflate_ns = atomic_load(&bgzf_deflate_ns);
+  c->crc_ns = atomic_load(&bgzf_crc_ns);
+  c->start = bgzf_clock_ns();
+}
+
+/* libdeflate_gzip_compress, timed as deflating: it computes the CRC32 along */
+static size_t
+bgzip_gzip_compress_timed(struct libdeflate_compressor *z, const void *in, size_t ilen,
+			  void *out, size_t olen)
+{
+  uint64 t0 = (bgzip_stats) ? bgzf_clock_ns() : 0;
+  size_t dlen = libdeflate_gzip_compress(z, in, ilen, out, olen);
+
+  if (t0) atomic_fetch_add(&bgzf_deflate_ns, bgzf_clock_ns() - t0);
+  return dlen;
+}
+
+/* Once the threads are joined: the time they spent is in the process counters by then */
+static void
+bgzip_stats_end(bgzip_stats_call *c, uint64 bytes_in, uint64 bytes_out, uint64 blocks)
+{
+  bgzip_stats_entry *e;
+
+  if (!bgzip_stats)
+    return;
+
+  e = &bgzip_stats->entries[c->fn][c->slot];
+  pg_atomic_fetch_add_u64(&e->calls, 1);
+  pg_atomic_fetch_add_u64(&e->bytes_in, bytes_in);
+  pg_atomic_fetch_add_u64(&e->bytes_out, bytes_out);
+  pg_atomic_fetch_add_u64(&e->blocks, blocks);
+  pg_atomic_fetch_add_u64(&e->time_ns, bgzf_clock_ns() - c->start);
+  pg_atomic_fetch_add_u64(&e->deflate_ns, atomic_load(&bgzf_deflate_ns) - c->deflate_ns);
+  pg_atomic_fetch_add_u64(&e->crc_ns, atomic_load(&bgzf_crc_ns) - c->crc_ns);
+}
+
+/*
+ * Progress
+ *
+ * With the preload too, each backend has a slot in shared memory where its running call
+ * publishes how many blocks it has done (BGZF blocks, gzip chunks, or array elements),
+ * out of how many if known, and the size of its input. Only the backend writes to its slot,
+ * the threads' work is published by the backend as it goes. bgzip.progress lists the busy slots.
+ */
+typedef struct bgzip_progress_slot {
+  pg_atomic_uint32 pid;            /* 0 when idle; set last, cleared first */
+  Oid userid;                      /* who runs the call, for the visibility of the details */
+  int fn;                          /* bgzip_stats_fn */
+  TimestampTz start;
+  pg_atomic_uint64 blocks_done;
+  pg_atomic_uint64 blocks_total;   /* 0 if unknown */
+  pg_atomic_uint64 bytes_total;
+} bgzip_progress_slot;
+
+static bgzip_progress_slot *bgzip_progress = NULL;  /* MaxBackends slots */
+static bgzip_progress_slot *bgzip_my_progress = NULL;
+static size_t bgzip_progress_blocks = 0;            /* what we published last */
+static size_t bgzip_progress_total = 0;
+
+/* Our slot: the backend id was replaced by the proc number in PG17. Out of range for aux processes */
+#if PG_VERSION_NUM >= 170000
+#define BGZIP_PROGRESS_SLOT() ((int)MyProcNumber)
+#else
+#define BGZIP_PROGRESS_SLOT() ((int)MyBackendId - 1)
+#endif
+
+static Size
+bgzip_progress_size(void)
+{
+  return mul_size(MaxBackends, sizeof(bgzip_progress_slot));
+}
+
+static void
+bgzip_progress_init(void)
+{
+  bool found;
+  int i;
+
+  bgzip_progress = (bgzip_progress_slot *)ShmemInitStruct("pg_bgzip progress", bgzip_progress_size(), &found);
+  if (!found) {
+    for (i = 0; i < MaxBackends; i++) {
+      pg_atomic_init_u32(&bgzip_progress[i].pid, 0);
+      pg_atomic_init_u64(&bgzip_progress[i].blocks_done, 0);
+      pg_atomic_init_u64(&bgzip_progress[i].blocks_total, 0);
+      pg_atomic_init_u64(&bgzip_progress[i].bytes_total, 0);
     }
+  }
+}
 
-    *dlen = clen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
-    
-    libdeflate_free_compressor(z);
+static void
+bgzip_progress_end(void)
+{
+  bgzip_progress_blocks = 0;
+  if (bgzip_my_progress)
+    pg_atomic_write_u32(&bgzip_my_progress->pid, 0);
+}
 
-    // write the header
-    memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
-    packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
+/* A failed call does not get to bgzip_progress_end */
+static void
+bgzip_progress_xact_callback(XactEvent event, void *arg)
+{
+  if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+    bgzip_progress_end();
+}
 
-    // write the footer
-    crc = libdeflate_crc32(0, src, slen);
-    packInt32((uint8_t*)&dst[*dlen - 8], crc);  // CRC
-    packInt32((uint8_t*)&dst[*dlen - 4], slen); // ISIZE
-    return 0;
+static void
+bgzip_progress_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				SubTransactionId parentSubid, void *arg)
+{
+  if (event == SUBXACT_EVENT_ABORT_SUB)
+    bgzip_progress_end();
 }
 
-PG_FUNCTION_INFO_V1(pg_bgzip_compress);
-Datum pg_bgzip_compress(PG_FUNCTION_ARGS)
+/* blocks_total is 0 when unknown */
+static void
+bgzip_progress_start(bgzip_stats_fn fn, uint64 bytes_total, uint64 blocks_total)
 {
-	bytea* compressed;
-	size_t compressed_size = 0;
+  bgzip_progress_blocks = 0;
+  bgzip_progress_total = blocks_total;
 
-	bytea* uncompressed = NULL;
-	int32 compression_level = -1;
-	uint8_t* in = NULL;
-	size_t in_size = 0;
+  if (!bgzip_progress || BGZIP_PROGRESS_SLOT() < 0 || BGZIP_PROGRESS_SLOT() >= MaxBackends)
+    return;
 
-	bool with_eof = false;
+  if (!bgzip_my_progress) {
+    bgzip_my_progress = &bgzip_progress[BGZIP_PROGRESS_SLOT()];
+    RegisterXactCallback(bgzip_progress_xact_callback, NULL);
+    RegisterSubXactCallback(bgzip_progress_subxact_callback, NULL);
+  }
 
-	if(PG_NARGS() != 2 && PG_NARGS() != 3){
-	  E("Invalid number of arguments: expected 2 or 3, got %d", PG_NARGS());
-	  PG_RETURN_NULL();
-	}
+  pg_atomic_write_u32(&bgzip_my_progress->pid, 0);
+  pg_write_barrier();
+  bgzip_my_progress->userid = GetUserId();
+  bgzip_my_progress->fn = fn;
+  bgzip_my_progress->start = GetCurrentTimestamp();
+  pg_atomic_write_u64(&bgzip_my_progress->blocks_done, 0);
+  pg_atomic_write_u64(&bgzip_my_progress->blocks_total, blocks_total);
+  pg_atomic_write_u64(&bgzip_my_progress->bytes_total, bytes_total);
+  pg_write_barrier();
+  pg_atomic_write_u32(&bgzip_my_progress->pid, MyProcPid);
+}
 
-	if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-	  E("Null arguments not accepted");
-	  PG_RETURN_NULL();
-	}
+static inline size_t
+bgzip_progress_get(void)
+{
+  return bgzip_progress_blocks;
+}
 
-	if(PG_NARGS() == 3 && !PG_ARGISNULL(2))
-	  with_eof = PG_GETARG_BOOL(2);
+/* Backend only */
+static inline void
+bgzip_progress_set(size_t blocks_done)
+{
+  /* the last task of a job can be short */
+  if (bgzip_progress_total && blocks_done > bgzip_progress_total)
+    blocks_done = bgzip_progress_total;
+  bgzip_progress_blocks = blocks_done;
+  if (bgzip_my_progress)
+    pg_atomic_write_u64(&bgzip_my_progress->blocks_done, blocks_done);
+}
 
-	uncompressed = PG_GETARG_BYTEA_PP(0);
-	compression_level = PG_GETARG_INT32(1);
-	in = (uint8_t*)(VARDATA_ANY(uncompressed));
-	in_size = VARSIZE_ANY_EXHDR(uncompressed);
+/*
+ * Thread pool
+ *
+ * The core thread pool (see bgzf.h), with the backend as worker 0.
+ *
+ * The extra threads must not call into Postgres: no palloc, no elog, nothing.
+ * They only read and write memory that the backend allocated for them beforehand,
+ * compressors included (see libdeflate_job_options).
+ */
+typedef struct bgzip_job {
+  bgzf_job core;
+  size_t progress_base;      /* progress blocks before this job */
+  size_t progress_unit;      /* progress blocks per task */
+} bgzip_job;
 
-	/* compression level -1 is default best effort (approx 6) */
-	/* level 0 is no compression, 1-9 are lowest to highest */
-	if (compression_level < -1 || compression_level > 9)
-		elog(ERROR, "invalid compression level: %d", compression_level);
+/* Called by the backend between its tasks */
+static int
+bgzip_job_poll(void *arg, size_t completed)
+{
+  bgzip_job *job = (bgzip_job *)arg;
+
+  bgzip_progress_set(job->progress_base + completed * job->progress_unit);
+  /* Not CHECK_FOR_INTERRUPTS() here: it might longjmp with the threads still running */
+  return InterruptPending;
+}
+
+/*
+ * Start (nthreads - 1) extra threads on the job. Worker 0 is the backend itself, see bgzip_job_wait.
+ * Each task counts for one block in the progress, unless progress_unit is changed before the wait.
+ */
+static void
+bgzip_job_start(bgzip_job *job, int nthreads, size_t ntasks, bgzf_task_fn fn, void *arg)
+{
+  int started;
 
-	compressed = (bytea *)palloc(VARHDRSZ); // start empty
+  job->progress_base = bgzip_progress_get();
+  job->progress_unit = 1;
 
-	/* Loop through the blocks */
-	while (in_size > 0){
+  started = bgzf_job_start(&job->core, nthreads, ntasks, fn, arg, bgzip_job_poll, job);
+  if (started < job->core.requested - 1)
+    D1("Started only %d threads out of %d", started, job->core.requested - 1);
+}
 
-	  size_t isize = (in_size < BGZIP_BLOCK_SIZE) ? in_size : BGZIP_BLOCK_SIZE;
-	  size_t dlen = BGZIP_MAX_BLOCK_SIZE;
+/*
+ * Work on the job from the backend too, and join the threads. Returns the lowest failed task, or SIZE_MAX.
+ * The backend checks for interrupts between its tasks: on one, it stops the threads, joins them,
+ * and only then processes it (a cancel does not come back). If it was harmless, the job goes on.
+ */
+static size_t
+bgzip_job_wait(bgzip_job *job)
+{
+  size_t failed;
 
-	  compressed = (bytea *)repalloc(compressed, compressed_size + dlen + VARHDRSZ);
+  for (;;) {
+    failed = bgzf_job_wait(&job->core);
 
-	  if(bgzip_compress_block(VARDATA(compressed) + compressed_size, &dlen,
-				  in, isize,
-				  compression_level))
-	    E("Error compressing the block at position %zu", in_size);
+    if (!bgzf_job_interrupted(&job->core))
+      break;
 
-	  in += isize;
-	  in_size -= isize;
-	  compressed_size += dlen;
-	}
+    CHECK_FOR_INTERRUPTS();
 
-	if(with_eof){
-	  N("bgzip_compress with EOF!");
-	  /* Add the EOF marker */
-	  compressed = (bytea *)repalloc(compressed, compressed_size + 28 + VARHDRSZ); // sizeof(marker)
-	  memcpy(VARDATA(compressed) + compressed_size, eof_marker, 28);
-	  compressed_size += 28;
-	}
+    if (!bgzf_job_resume(&job->core))
+      break;
+  }
 
-	SET_VARSIZE(compressed, compressed_size + VARHDRSZ);
+  bgzip_progress_set(job->progress_base + atomic_load(&job->core.completed) * job->progress_unit);
+  return failed;
+}
 
-	PG_RETURN_BYTEA_P(compressed);
+/* Stop handing out tasks, and join the threads. For error paths: safe to call on a finished job */
+static inline void
+bgzip_job_abort(bgzip_job *job)
+{
+  bgzf_job_abort(&job->core);
+}
+
+/*
+ * The compressors of the extra threads are allocated by the backend, before the job starts,
+ * in the memory context of the call: an error or a cancel while they run does not leak them.
+ * libdeflate does not allocate while (de)compressing, so the threads never palloc.
+ */
+static void *bgzip_job_alloc(size_t size)
+{
+  return MemoryContextAllocHuge(CurrentMemoryContext, size);
 }
 
+static struct libdeflate_options libdeflate_job_options = {
+  .sizeof_options = sizeof(struct libdeflate_options),
+  .malloc_func = bgzip_job_alloc,
+  .free_func = pfree,
+};
 
-PG_FUNCTION_INFO_V1(pg_bgzip_gzip_compress);
-Datum pg_bgzip_gzip_compress(PG_FUNCTION_ARGS)
+/* Incompressibility (see bgzf_entropy), with the bgzip.stored_entropy threshold */
+static inline bool
+bgzip_is_incompressible(const uint8_t *src, size_t slen)
+{
+  return bgzf_is_incompressible(src, slen, bgzip_stored_entropy);
+}
+
+/* Threshold for bgzf_compress_block: blocks are only stored in adaptive mode */
+static inline double
+bgzip_block_entropy(void)
+{
+  return (bgzip_adaptive) ? bgzip_stored_entropy : 8.0;
+}
+
+/* Counters of the last compression call, in this backend */
+static struct {
+  uint64 blocks;
+  uint64 stored_blocks;
+} bgzip_last_call;
+
+static inline void
+bgzip_last_call_reset(void)
+{
+  bgzip_last_call.blocks = 0;
+  bgzip_last_call.stored_blocks = 0;
+}
+
+/*
+ * Multi-threaded compression
+ *
+ * Each block is compressed at a fixed stride (its bound) in the output buffer,
+ * and the blocks are then packed in order, so that the result is
+ * byte-identical to the single-threaded loop.
+ */
+typedef struct bgzip_compress_job {
+  const uint8_t *in;
+  size_t in_size;
+  uint8_t *out;
+  size_t stride;
+  size_t *sizes;
+  double stored_entropy;    /* see bgzip_block_entropy */
+  atomic_size_t stored;     /* blocks that took the stored path */
+  struct libdeflate_compressor *z[BGZF_MAX_THREADS];
+} bgzip_compress_job;
+
+static int
+bgzip_compress_task(void *arg, size_t block, int worker)
+{
+  bgzip_compress_job *cj = (bgzip_compress_job *)arg;
+  size_t offset = block * BGZF_BLOCK_SIZE;
+  size_t isize = cj->in_size - offset;
+  size_t dlen = cj->stride;
+  int rc;
+
+  if (isize > BGZF_BLOCK_SIZE) isize = BGZF_BLOCK_SIZE;
+
+  rc = bgzf_compress_block(cj->z[worker], cj->out + block * cj->stride, &dlen,
+			    cj->in + offset, isize, cj->stored_entropy);
+  if (rc < 0)
+    return -1;
+  if (rc > 0)
+    atomic_fetch_add(&cj->stored, 1);
+
+  cj->sizes[block] = dlen;
+  return 0;
+}
+
+/*
+ * The backend uses its cached compressor, the threads get their own.
+ * libdeflate_job_options allocates with palloc: out of memory is an error, not a NULL
+ */
+static void
+bgzip_compress_job_init(bgzip_compress_job *cj, int level, int nthreads)
+{
+  int i;
+
+  if (level == -1) level = BGZIP_DEFAULT_LEVEL;
+
+  cj->stored_entropy = bgzip_block_entropy();
+  atomic_init(&cj->stored, 0);
+
+  memset(cj->z, 0, sizeof(cj->z));
+  cj->z[0] = bgzip_get_compressor(level);
+  for (i = 1; i < nthreads; i++)
+    cj->z[i] = libdeflate_alloc_compressor_ex(level, &libdeflate_job_options);
+}
+
+static void
+bgzip_compress_job_free(bgzip_compress_job *cj)
+{
+  int i;
+  for (i = 1; i < BGZF_MAX_THREADS; i++) {
+    if (cj->z[i]) libdeflate_free_compressor(cj->z[i]);
+    cj->z[i] = NULL;
+  }
+}
+
+/* Pack the nblocks blocks, in order, at the start of out. Returns the compressed size */
+static size_t
+bgzip_compress_job_pack(bgzip_compress_job *cj, size_t nblocks)
+{
+  size_t block, out_size = 0;
+
+  for (block = 0; block < nblocks; block++) {
+    memmove(cj->out + out_size, cj->out + block * cj->stride, cj->sizes[block]);
+    out_size += cj->sizes[block];
+  }
+  return out_size;
+}
+
+/*
+ * Input source
+ *
+ * A large value stored out-of-line and uncompressed (the usual case for bytea columns
+ * with EXTERNAL storage, or when pglz gave up) is not detoasted as a whole: it is read
+ * in slices of a few blocks, so that its uncompressed form never sits entirely in memory.
+ * Anything else is detoasted as usual: compressed values could only be sliced by
+ * decompressing them again from the start, for each slice.
+ */
+#define BGZIP_SLICE_BLOCKS 64 /* about 4MB */
+
+typedef struct bgzip_source {
+  Datum datum;         /* as given */
+  bytea *content;      /* detoasted, unless sliced */
+  size_t size;
+  bool sliced;
+} bgzip_source;
+
+static void
+bgzip_source_init(bgzip_source *src, Datum datum)
+{
+  struct varlena *attr = (struct varlena *)DatumGetPointer(datum);
+
+  src->datum = datum;
+  src->content = NULL;
+  src->sliced = false;
+
+  if (VARATT_IS_EXTERNAL_ONDISK(attr)) {
+    struct varatt_external toast_pointer;
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+    if (!VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer)) {
+      src->sliced = true;
+      src->size = toast_pointer.va_rawsize - VARHDRSZ;
+      return;
+    }
+  }
+
+  src->content = DatumGetByteaPP(datum);
+  src->size = VARSIZE_ANY_EXHDR(src->content);
+}
+
+/* The bytes [offset, offset+length) of the source. If *slice is set, pfree it when done */
+static const uint8_t *
+bgzip_source_read(bgzip_source *src, size_t offset, size_t length, bytea **slice)
+{
+  *slice = NULL;
+
+  if (!src->sliced)
+    return (const uint8_t*)VARDATA_ANY(src->content) + offset;
+
+  *slice = DatumGetByteaPSlice(src->datum, (int32)offset, (int32)length);
+  if (VARSIZE_ANY_EXHDR(*slice) != length)
+    E("Short read from the TOASTed value: %zu bytes at offset %zu, instead of %zu",
+      (size_t)VARSIZE_ANY_EXHDR(*slice), offset, length);
+
+  return (const uint8_t*)VARDATA_ANY(*slice);
+}
+
+/*
+ * "auto" compression level
+ *
+ * We keep, per backend, a moving average of the throughput (input MB per second of
+ * wall-clock time, threads included) measured at each level, and climb one level at a
+ * time: up while the next level is untried or fast enough, down as soon as the current
+ * one falls below bgzip.target_mbps. Level 0 is never picked: that is not compressing.
+ * The averages of the levels not in use go stale: one not measured over the last
+ * BGZIP_AUTO_STALE batches is forgotten, so a slow moment (or a hard to compress input)
+ * does not keep the next level out for good, it gets tried again.
+ */
+#define BGZIP_AUTO_BATCH 16      /* blocks (1MB) per measurement, at least */
+#define BGZIP_AUTO_WEIGHT 0.25   /* of the new measurement in the average */
+#define BGZIP_AUTO_STALE 64      /* batches */
+
+static double bgzip_level_mbps[BGZIP_MAX_LEVEL + 1]; /* 0 until measured */
+static uint64 bgzip_level_batch[BGZIP_MAX_LEVEL + 1]; /* when last measured */
+static uint64 bgzip_auto_batches = 0;
+static int bgzip_auto_current = BGZIP_DEFAULT_LEVEL;
+
+static int
+bgzip_auto_level(void)
+{
+  return bgzip_auto_current;
+}
+
+static void
+bgzip_auto_update(int level, size_t bytes, instr_time elapsed)
+{
+  double seconds = INSTR_TIME_GET_DOUBLE(elapsed);
+  double mbps;
+
+  if (seconds <= 0)
+    return;
+
+  mbps = (double)bytes / (1024 * 1024) / seconds;
+  bgzip_level_batch[level] = ++bgzip_auto_batches;
+  if (bgzip_level_mbps[level] == 0)
+    bgzip_level_mbps[level] = mbps;
+  else
+    bgzip_level_mbps[level] += BGZIP_AUTO_WEIGHT * (mbps - bgzip_level_mbps[level]);
+
+  if (level < BGZIP_MAX_LEVEL && bgzip_level_mbps[level + 1] != 0 &&
+      bgzip_auto_batches - bgzip_level_batch[level + 1] > BGZIP_AUTO_STALE)
+    bgzip_level_mbps[level + 1] = 0;
+
+  if (bgzip_level_mbps[level] < bgzip_target_mbps) {
+    if (level > 1) level--;
+  } else if (level < BGZIP_MAX_LEVEL &&
+	     (bgzip_level_mbps[level + 1] == 0 || bgzip_level_mbps[level + 1] >= bgzip_target_mbps)) {
+    level++;
+  }
+
+  D2("auto level: %.1f MB/s (average %.1f) at level %d, next is %d",
+     mbps, bgzip_level_mbps[bgzip_auto_current], bgzip_auto_current, level);
+  bgzip_auto_current = level;
+}
+
+/*
+ * Compress the source into BGZF blocks, batch by batch.
+ * If block_sizes is not NULL, it receives the compressed size of each block.
+ * start_memory is only used to report the peak memory of the call.
+ * With BGZIP_AUTO_LEVEL, each batch is timed and the level is picked again for the next one.
+ */
+static bytea *
+bgzip_compress_content(bgzip_source *src,
+		       int compression_level, bool with_eof,
+		       size_t *block_sizes, Size start_memory)
 {
 	bytea* compressed;
 	size_t compressed_size = 0;
-	bytea* uncompressed = NULL;
-	int32 compression_level = 0;
-	const void* in;
-	size_t ilen = 0;
-	size_t dlen = 0;
-	struct libdeflate_options options;
 	struct libdeflate_compressor *z = NULL;
+	size_t nblocks, block, batch, first;
+	size_t *sizes = block_sizes;
+	int nthreads;
+	size_t stride, alloc_size;
+	Size peak_memory = 0, memory;
+	bool automatic = (compression_level == BGZIP_AUTO_LEVEL);
+	bgzip_stats_call stats;
+	bgzip_compress_job cj;
+	int cj_level = 0;
+	bgzip_job job;
 
-	if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-	  E("Null arguments not accepted");
-	  PG_RETURN_NULL();
+	bgzip_stats_begin(&stats, BGZIP_FN_COMPRESS, compression_level);
+
+	/* The bound is the same for all levels but 0, which auto never picks */
+	z = (automatic) ? NULL : bgzip_get_compressor(compression_level);
+
+	nblocks = (src->size + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+	bgzip_last_call_reset();
+	bgzip_last_call.blocks = nblocks;
+	bgzip_progress_start(BGZIP_FN_COMPRESS, src->size, nblocks);
+	nthreads = (nblocks < (size_t)bgzip_max_threads) ? (int)nblocks : bgzip_max_threads;
+
+	/* Allocate the output once, large enough for the worst case, and shrink it at the end */
+	stride = bgzf_block_bound(z);
+	alloc_size = nblocks * stride + ((with_eof) ? BGZF_EOF_LENGTH : 0) + VARHDRSZ;
+	compressed = (bytea *)MemoryContextAllocHuge(CurrentMemoryContext, alloc_size);
+
+	/* The compressors of the threads, set up once for all the batches, and again only when auto changes the level */
+	if (nthreads > 1) {
+	  if (!sizes)
+	    sizes = (size_t *)palloc(nblocks * sizeof(size_t));
+	  cj.stride = stride;
+	  cj_level = (automatic) ? bgzip_auto_level() : compression_level;
+	  bgzip_compress_job_init(&cj, cj_level, nthreads);
 	}
 
-	compression_level = PG_GETARG_INT32(1);
+	/* One batch for a detoasted input. Enough blocks to keep the threads busy for a sliced one */
+	batch = (src->sliced) ? Max(BGZIP_SLICE_BLOCKS, 8 * (size_t)nthreads) : nblocks;
+	if (automatic) batch = Max(BGZIP_AUTO_BATCH, 8 * (size_t)nthreads);
 
-	/* compression level -1 is default best effort (approx 6) */
-	/* level 0 is no compression, 1-9 are lowest to highest */
-	if (compression_level < -1 || compression_level > 9)
-		elog(ERROR, "invalid compression level: %d", compression_level);
+	for (first = 0; first < nblocks; first += batch) {
 
-	uncompressed = PG_GETARG_BYTEA_P(0);
-	in = (const void*)(VARDATA_ANY(uncompressed));
-	ilen = VARSIZE_ANY_EXHDR(uncompressed);
+	  size_t n = Min(batch, nblocks - first);
+	  size_t offset = first * BGZF_BLOCK_SIZE;
+	  size_t in_size = Min(n * BGZF_BLOCK_SIZE, src->size - offset);
+	  bytea *slice;
+	  const uint8_t *in = bgzip_source_read(src, offset, in_size, &slice);
+	  size_t batch_size = in_size;
+	  instr_time start, elapsed;
 
-	dlen = ilen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH; // yup, bigger, that'll fit them all
-	compressed = (bytea *)palloc(dlen + VARHDRSZ); 
+	  if (automatic) {
+	    compression_level = bgzip_auto_level();
+	    z = bgzip_get_compressor(compression_level);
+	    if (nthreads > 1 && compression_level != cj_level) {
+	      bgzip_last_call.stored_blocks += atomic_load(&cj.stored);
+	      bgzip_compress_job_free(&cj);
+	      cj_level = compression_level;
+	      bgzip_compress_job_init(&cj, cj_level, nthreads);
+	    }
+	    /* after any reallocation: only the compression is measured */
+	    INSTR_TIME_SET_CURRENT(start);
+	  }
 
-	memset(&options, 0, sizeof(options));
-	options.sizeof_options = sizeof(options);
-	options.malloc_func = palloc0;
-	options.free_func = pfree;
-	
-	z = libdeflate_alloc_compressor_ex(compression_level, &options);
-	if (!z)
-	  goto bailout;
+	  memory = MemoryContextMemAllocated(CurrentMemoryContext, true);
+	  if (memory > peak_memory) peak_memory = memory;
 
-	// Raw deflate-gzip
-	if ( (dlen = libdeflate_gzip_compress(z, in, ilen, VARDATA(compressed), dlen)) <= 0) {
-	  W("libdeflate_gzip_compress failed");
-	  goto bailout;
-	}
+	  if (nthreads > 1) {
+	    size_t failed;
 
-	libdeflate_free_compressor(z);
+	    /* There is room for n strides after the blocks so far: they are at most one stride each */
+	    cj.in = in;
+	    cj.in_size = in_size;
+	    cj.out = (uint8_t*)VARDATA(compressed) + compressed_size;
+	    cj.sizes = sizes + first;
 
-	SET_VARSIZE(compressed, dlen + VARHDRSZ);
-	PG_RETURN_BYTEA_P(compressed);
+	    D1("Compressing %zu blocks with %d threads", n, (int)Min((size_t)nthreads, n));
+	    bgzip_job_start(&job, (int)Min((size_t)nthreads, n), n, bgzip_compress_task, &cj);
+	    failed = bgzip_job_wait(&job);
+	    if (failed != SIZE_MAX)
+	      E("Error compressing the block at position %zu", (first + failed) * BGZF_BLOCK_SIZE);
 
-bailout:
+	    compressed_size += bgzip_compress_job_pack(&cj, n);
+	    in_size = 0; /* all done */
+	  }
 
-	if(compressed) pfree(compressed);
+	  /* Loop through the blocks */
+	  for (block = first; in_size > 0; block++){
 
-	if(z) libdeflate_free_compressor(z);
-	PG_RETURN_NULL();
+	    size_t isize = (in_size < BGZF_BLOCK_SIZE) ? in_size : BGZF_BLOCK_SIZE;
+	    size_t dlen = stride;
+	    int rc;
+
+	    CHECK_FOR_INTERRUPTS();
+
+	    rc = bgzf_compress_block(z, (uint8_t*)VARDATA(compressed) + compressed_size, &dlen,
+					  in, isize, bgzip_block_entropy());
+	    if (rc < 0)
+	      E("Error compressing the block at position %zu", block * BGZF_BLOCK_SIZE);
+	    bgzip_last_call.stored_blocks += rc;
+
+	    if (block_sizes) block_sizes[block] = dlen;
+	    bgzip_progress_set(block + 1);
+
+	    in += isize;
+	    in_size -= isize;
+	    compressed_size += dlen;
+	  }
+
+	  if (automatic) {
+	    INSTR_TIME_SET_CURRENT(elapsed);
+	    INSTR_TIME_SUBTRACT(elapsed, start);
+	    bgzip_auto_update(compression_level, batch_size, elapsed);
+	  }
+
+	  if (slice) pfree(slice);
+	}
+
+	if (nthreads > 1) {
+	  bgzip_last_call.stored_blocks += atomic_load(&cj.stored);
+	  bgzip_compress_job_free(&cj);
+	}
+	if (sizes && sizes != block_sizes) pfree(sizes);
+
+	if(with_eof){
+	  N("bgzip_compress with EOF!");
+	  /* Add the EOF marker */
+	  memcpy(VARDATA(compressed) + compressed_size, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	  compressed_size += BGZF_EOF_LENGTH;
+	}
+
+	if (compressed_size + VARHDRSZ > MaxAllocSize)
+	  E("Compressed content too large: %zu bytes", compressed_size);
+
+	compressed = (bytea *)repalloc(compressed, compressed_size + VARHDRSZ);
+
+	D1("Compressed %zu bytes%s into %zu bytes in %zu blocks (%lu stored) | output buffer: %zu bytes | peak memory: %zu bytes",
+	   src->size, (src->sliced) ? " (sliced)" : "", compressed_size, nblocks,
+	   (unsigned long)bgzip_last_call.stored_blocks, alloc_size,
+	   peak_memory - start_memory);
+
+	SET_VARSIZE(compressed, compressed_size + VARHDRSZ);
+	bgzip_stats_end(&stats, src->size, compressed_size, nblocks);
+	bgzip_progress_end();
+	return compressed;
+}
+
+/* level is either an int or a text: a number, or "auto" */
+static Datum
+bgzip_compress_args(FunctionCallInfo fcinfo, bool text_level)
+{
+	bgzip_source src;
+	int32 compression_level = -1;
+	bool with_eof = false;
+	Size start_memory;
+
+	/* before the input gets (maybe) detoasted */
+	start_memory = MemoryContextMemAllocated(CurrentMemoryContext, true);
+
+	if(PG_NARGS() != 2 && PG_NARGS() != 3){
+	  E("Invalid number of arguments: expected 2 or 3, got %d", PG_NARGS());
+	  PG_RETURN_NULL();
+	}
+
+	if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+	  E("Null arguments not accepted");
+	  PG_RETURN_NULL();
+	}
+
+	if(PG_NARGS() == 3 && !PG_ARGISNULL(2))
+	  with_eof = PG_GETARG_BOOL(2);
+
+	if (text_level) {
+	  char *level = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	  char *end;
+
+	  if (pg_strcasecmp(level, "auto") == 0) {
+	    compression_level = BGZIP_AUTO_LEVEL;
+	  } else {
+	    errno = 0;
+	    compression_level = (int32)strtol(level, &end, 10);
+	    if (errno || end == level || *end != '\0' || compression_level < -1)
+	      elog(ERROR, "invalid compression level: \"%s\"", level);
+	  }
+	  pfree(level);
+	} else {
+	  compression_level = PG_GETARG_INT32(1);
+	}
+
+	/* compression level -1 is default best effort (approx 6) */
+	/* level 0 is no compression, 1-12 are lowest to highest */
+	if (compression_level != BGZIP_AUTO_LEVEL &&
+	    (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL))
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	bgzip_source_init(&src, PG_GETARG_DATUM(0));
+
+	PG_RETURN_BYTEA_P(bgzip_compress_content(&src, compression_level, with_eof,
+						 NULL, start_memory));
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress);
+Datum pg_bgzip_compress(PG_FUNCTION_ARGS)
+{
+	return bgzip_compress_args(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_text_level);
+Datum pg_bgzip_compress_text_level(PG_FUNCTION_ARGS)
+{
+	return bgzip_compress_args(fcinfo, true);
+}
+
+/*
+ * Metadata
+ *
+ * Sizes, block count and validity come from the 18-byte headers and 8-byte footers alone,
+ * jumping from block to block by BSIZE: no data is inflated.
+ * A sliced source is read in windows of 16 maximal blocks (1MB), each holding the headers
+ * and footers of many blocks, instead of detoasting the whole value; the next window is
+ * read only when a block does not fit whole in the current one.
+ */
+#define BGZIP_WALK_WINDOW (16 * BGZF_MAX_BLOCK_SIZE)
+
+typedef struct bgzip_header_walk {
+  bgzip_source src;
+  const uint8_t *in;                 /* unless sliced */
+  size_t coffset;                    /* of the next block */
+  size_t uoffset;
+  size_t nblocks;                    /* walked so far */
+  bytea *window;                     /* sliced: the bytes [window_start, window_end) */
+  size_t window_start;
+  size_t window_end;
+} bgzip_header_walk;
+
+static void
+bgzip_header_walk_init(bgzip_header_walk *w, Datum datum)
+{
+  bgzip_source_init(&w->src, datum);
+  w->in = (w->src.sliced) ? NULL : (const uint8_t*)VARDATA_ANY(w->src.content);
+  w->coffset = 0;
+  w->uoffset = 0;
+  w->nblocks = 0;
+  w->window = NULL;
+  w->window_start = 0;
+  w->window_end = 0;
+}
+
+/* Returns 1 with the next block in *b, 0 at the end of the content, or -1 if there is no valid block at w->coffset */
+static int
+bgzip_header_walk_next(bgzip_header_walk *w, bgzf_block *b)
+{
+  size_t avail = w->src.size - w->coffset;
+  /* a block is at most that long */
+  size_t len = Min(avail, BGZF_MAX_BLOCK_SIZE);
+  const uint8_t *p;
+
+  if (avail == 0)
+    return 0;
+
+  CHECK_FOR_INTERRUPTS();
+
+  if (!w->src.sliced)
+    p = w->in + w->coffset;
+  else {
+    if (w->coffset < w->window_start || w->coffset + len > w->window_end) {
+      size_t n = Min(avail, BGZIP_WALK_WINDOW);
+
+      if (w->window) pfree(w->window);
+      bgzip_source_read(&w->src, w->coffset, n, &w->window);
+      w->window_start = w->coffset;
+      w->window_end = w->coffset + n;
+    }
+    p = (const uint8_t*)VARDATA_ANY(w->window) + (w->coffset - w->window_start);
+  }
+
+  if (bgzf_parse_block(p, len, b))
+    return -1;
+
+  b->coffset = w->coffset;
+  b->uoffset = w->uoffset;
+  w->coffset += b->csize;
+  w->uoffset += b->usize;
+  w->nblocks++;
+  return 1;
+}
+
+/* Walk to the end. Returns false on an invalid block, at w->coffset */
+static bool
+bgzip_header_walk_all(bgzip_header_walk *w)
+{
+  bgzf_block b;
+  int rc;
+
+  while ((rc = bgzip_header_walk_next(w, &b)) > 0)
+    ;
+  return rc == 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_uncompressed_size);
+Datum pg_bgzip_uncompressed_size(PG_FUNCTION_ARGS)
+{
+	bgzip_header_walk w;
+
+	bgzip_header_walk_init(&w, PG_GETARG_DATUM(0));
+	if (!bgzip_header_walk_all(&w))
+	  E("Invalid BGZF block at offset %zu", w.coffset);
+
+	PG_RETURN_INT64((int64)w.uoffset);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_block_count);
+Datum pg_bgzip_block_count(PG_FUNCTION_ARGS)
+{
+	bgzip_header_walk w;
+
+	bgzip_header_walk_init(&w, PG_GETARG_DATUM(0));
+	if (!bgzip_header_walk_all(&w))
+	  E("Invalid BGZF block at offset %zu", w.coffset);
+
+	PG_RETURN_INT64((int64)w.nblocks);
+}
+
+/* Structure only: the CRC32s are not checked, that takes inflating */
+PG_FUNCTION_INFO_V1(pg_bgzip_validate);
+Datum pg_bgzip_validate(PG_FUNCTION_ARGS)
+{
+	bgzip_header_walk w;
+
+	bgzip_header_walk_init(&w, PG_GETARG_DATUM(0));
+	PG_RETURN_BOOL(bgzip_header_walk_all(&w));
+}
+
+/* As htslib's bgzf_check_EOF: only the last 28 bytes are read */
+PG_FUNCTION_INFO_V1(pg_bgzip_has_eof);
+Datum pg_bgzip_has_eof(PG_FUNCTION_ARGS)
+{
+	bgzip_source src;
+	const uint8_t *tail;
+	bytea *slice;
+	bool has_eof;
+
+	bgzip_source_init(&src, PG_GETARG_DATUM(0));
+	if (src.size < BGZF_EOF_LENGTH)
+	  PG_RETURN_BOOL(false);
+
+	tail = bgzip_source_read(&src, src.size - BGZF_EOF_LENGTH, BGZF_EOF_LENGTH, &slice);
+	has_eof = (memcmp(tail, bgzf_eof_marker, BGZF_EOF_LENGTH) == 0);
+	if (slice) pfree(slice);
+
+	PG_RETURN_BOOL(has_eof);
+}
+
+/* One row per block. The CRC32 is unsigned: it comes as a bigint */
+PG_FUNCTION_INFO_V1(pg_bgzip_blocks);
+Datum pg_bgzip_blocks(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	bgzip_header_walk w;
+	bgzf_block b;
+	Datum values[6];
+	bool nulls[6] = { false, false, false, false, false, false };
+	int rc;
+
+	InitMaterializedSRF(fcinfo, 0);
+	bgzip_header_walk_init(&w, PG_GETARG_DATUM(0));
+
+	while ((rc = bgzip_header_walk_next(&w, &b)) > 0) {
+	  values[0] = Int64GetDatum((int64)b.coffset);
+	  values[1] = Int32GetDatum((int32)b.csize);
+	  values[2] = Int64GetDatum((int64)b.uoffset);
+	  values[3] = Int32GetDatum((int32)b.usize);
+	  values[4] = Int64GetDatum((int64)b.crc);
+	  values[5] = BoolGetDatum(bgzf_is_eof_block(&b));
+	  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	if (rc < 0)
+	  E("Invalid BGZF block at offset %zu", w.coffset);
+
+	return (Datum) 0;
+}
+
+/*
+ * GZI index (htslib's .gzi)
+ *
+ * A little-endian uint64 count, followed by that many (compressed offset, uncompressed offset)
+ * uint64 pairs: one per data block, pointing at its end, ie the start of the next block.
+ * The implicit first entry (0, 0) is not stored.
+ */
+#define GZI_ENTRY_LENGTH 16
+
+/* Build the index from the blocks (csize and usize). Empty blocks, like the EOF marker, get no entry */
+static bytea *
+bgzip_build_gzi(const bgzf_block *blocks, size_t nblocks)
+{
+  size_t i, n = 0;
+  uint64_t coffset = 0, uoffset = 0;
+  bytea *index = (bytea *)palloc(VARHDRSZ + 8 + nblocks * GZI_ENTRY_LENGTH);
+  uint8_t *p = (uint8_t*)VARDATA(index) + 8;
+
+  for (i = 0; i < nblocks; i++) {
+    coffset += blocks[i].csize;
+    uoffset += blocks[i].usize;
+    if (blocks[i].usize == 0)
+      continue;
+    packInt64(p, coffset);
+    packInt64(p + 8, uoffset);
+    p += GZI_ENTRY_LENGTH;
+    n++;
+  }
+  packInt64((uint8_t*)VARDATA(index), n);
+  SET_VARSIZE(index, VARHDRSZ + 8 + n * GZI_ENTRY_LENGTH);
+  return index;
+}
+
+/* Find, with a binary search, the block holding the uncompressed offset, and where in it */
+static void
+bgzip_gzi_seek(const bytea *index, size_t offset, size_t *coffset, size_t *skip)
+{
+  const uint8_t *entries = (const uint8_t*)VARDATA_ANY(index) + 8;
+  size_t len = VARSIZE_ANY_EXHDR(index);
+  uint64_t n, lo = 0, hi;
+  uint64_t c = 0, u = 0; /* the implicit first entry */
+
+  if (len < 8 || (len - 8) % GZI_ENTRY_LENGTH != 0)
+    E("Invalid GZI index: %zu bytes", len);
+
+  n = unpackInt64((const uint8_t*)VARDATA_ANY(index));
+  if (n != (len - 8) / GZI_ENTRY_LENGTH)
+    E("Invalid GZI index: %lu entries in %zu bytes", (unsigned long)n, len);
+
+  /* last entry with uoffset <= offset */
+  hi = n;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (unpackInt64(entries + mid * GZI_ENTRY_LENGTH + 8) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0) {
+    c = unpackInt64(entries + (lo - 1) * GZI_ENTRY_LENGTH);
+    u = unpackInt64(entries + (lo - 1) * GZI_ENTRY_LENGTH + 8);
+  }
+
+  *coffset = c;
+  *skip = offset - u;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_build_index);
+Datum pg_bgzip_build_index(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = PG_GETARG_BYTEA_PP(0);
+	size_t in_size = VARSIZE_ANY_EXHDR(compressed);
+	bgzf_block *blocks = NULL;
+	size_t nblocks = 0, usize = 0, walked;
+
+	walked = bgzf_walk((const uint8_t*)VARDATA_ANY(compressed), in_size, &blocks, &nblocks, &usize);
+	if (walked != in_size)
+	  E("Invalid BGZF block at offset %zu", walked);
+
+	PG_RETURN_BYTEA_P(bgzip_build_gzi(blocks, nblocks));
+}
+
+/* bgzip.compress, and the index of what it produced, from the block sizes */
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_with_index);
+Datum pg_bgzip_compress_with_index(PG_FUNCTION_ARGS)
+{
+	int32 compression_level = PG_GETARG_INT32(1);
+	bool with_eof = PG_GETARG_BOOL(2);
+	Size start_memory = MemoryContextMemAllocated(CurrentMemoryContext, true);
+	bgzip_source src;
+	size_t in_size, nblocks;
+	size_t *sizes, i;
+	bgzf_block *blocks;
+	bytea *compressed;
+	TupleDesc tupdesc;
+	Datum values[2];
+	bool nulls[2] = { false, false };
+
+	if (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL)
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+	  E("Function returning record called in context that cannot accept type record");
+
+	bgzip_source_init(&src, PG_GETARG_DATUM(0));
+	in_size = src.size;
+	nblocks = (in_size + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+
+	sizes = (size_t *)palloc((nblocks + 1) * sizeof(size_t));
+	compressed = bgzip_compress_content(&src, compression_level, with_eof,
+					    sizes, start_memory);
+
+	blocks = (bgzf_block *)palloc((nblocks + 1) * sizeof(bgzf_block));
+	for (i = 0; i < nblocks; i++) {
+	  blocks[i].csize = sizes[i];
+	  blocks[i].usize = (i < nblocks - 1) ? BGZF_BLOCK_SIZE : in_size - i * BGZF_BLOCK_SIZE;
+	}
+
+	values[0] = PointerGetDatum(compressed);
+	values[1] = PointerGetDatum(bgzip_build_gzi(blocks, nblocks));
+
+	pfree(sizes);
+	pfree(blocks);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * Parallel gzip (pigz-style)
+ *
+ * The input is cut in fixed-size chunks, compressed concurrently, each into its own
+ * gzip member: gunzip reads multi-member streams as one.
+ *
+ * A sliced source (see bgzip_source) is read a batch of chunks at a time, and only the
+ * first batch gets the incompressibility check.
+ *
+ * A single member is not threaded: libdeflate only produces complete deflate streams,
+ * which do not concatenate, so the whole input takes one libdeflate_gzip_compress call.
+ */
+#define BGZIP_GZIP_CHUNK (1024 * 1024)
+
+/* Same job as bgzip_compress_task, with chunks and gzip members instead of blocks */
+static int
+bgzip_gzip_member_task(void *arg, size_t chunk, int worker)
+{
+  bgzip_compress_job *cj = (bgzip_compress_job *)arg;
+  size_t offset = chunk * BGZIP_GZIP_CHUNK;
+  size_t isize = Min(cj->in_size - offset, (size_t)BGZIP_GZIP_CHUNK);
+  size_t dlen;
+
+  dlen = bgzip_gzip_compress_timed(cj->z[worker], cj->in + offset, isize,
+				   cj->out + chunk * cj->stride, cj->stride);
+  if (dlen == 0)
+    return -1;
+
+  cj->sizes[chunk] = dlen;
+  return 0;
+}
+
+static bytea *
+bgzip_gzip_compress_parallel(bgzip_source *src, int level, int nthreads)
+{
+  size_t ilen = src->size;
+  size_t nchunks = (ilen + BGZIP_GZIP_CHUNK - 1) / BGZIP_GZIP_CHUNK;
+  size_t batch, first, failed, dlen = 0;
+  bgzip_compress_job cj;
+  bgzip_job job;
+  bytea *compressed = NULL;
+
+  if ((size_t)nthreads > nchunks) nthreads = (int)nchunks;
+
+  /* One batch for a detoasted input. Two chunks per thread for a sliced one */
+  batch = (src->sliced) ? 2 * (size_t)nthreads : nchunks;
+
+  for (first = 0; first < nchunks; first += batch) {
+
+    size_t n = Min(batch, nchunks - first);
+    size_t offset = first * BGZIP_GZIP_CHUNK;
+    bytea *slice;
+
+    cj.in_size = Min(n * BGZIP_GZIP_CHUNK, ilen - offset);
+    cj.in = bgzip_source_read(src, offset, cj.in_size, &slice);
+
+    if (first == 0) {
+      /* Incompressible: stored blocks (level 0), without trying to deflate */
+      if (level != 0 && bgzip_is_incompressible(cj.in, cj.in_size)) {
+	D1("gzip_compress: incompressible content, storing it");
+	level = 0;
+      }
+
+      cj.stride = libdeflate_gzip_compress_bound(bgzip_get_compressor(level), BGZIP_GZIP_CHUNK);
+      compressed = (bytea *)MemoryContextAllocHuge(CurrentMemoryContext, nchunks * cj.stride + VARHDRSZ);
+      cj.sizes = (size_t *)palloc(batch * sizeof(size_t));
+      bgzip_compress_job_init(&cj, level, nthreads);
+      D1("gzip-compressing %zu chunks%s with %d threads", nchunks, (src->sliced) ? " (sliced)" : "", nthreads);
+    }
+
+    /* There is room for n strides after the members so far: they are at most one stride each */
+    cj.out = (uint8_t*)VARDATA(compressed) + dlen;
+
+    bgzip_job_start(&job, (int)Min((size_t)nthreads, n), n, bgzip_gzip_member_task, &cj);
+    failed = bgzip_job_wait(&job);
+    if (failed != SIZE_MAX)
+      E("Error compressing the chunk at position %zu", (first + failed) * BGZIP_GZIP_CHUNK);
+
+    dlen += bgzip_compress_job_pack(&cj, n);
+    if (slice) pfree(slice);
+  }
+
+  bgzip_compress_job_free(&cj);
+  pfree(cj.sizes);
+
+  if (dlen + VARHDRSZ > MaxAllocSize)
+    E("Compressed content too large: %zu bytes", dlen);
+
+  compressed = (bytea *)repalloc(compressed, dlen + VARHDRSZ);
+  SET_VARSIZE(compressed, dlen + VARHDRSZ);
+  return compressed;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_gzip_compress);
+Datum pg_bgzip_gzip_compress(PG_FUNCTION_ARGS)
+{
+	bytea* compressed;
+	bytea* uncompressed = NULL;
+	bgzip_source src;
+	int32 compression_level = 0;
+	int level;                 /* the one used: compression_level, unless the input is incompressible */
+	const void* in;
+	size_t ilen = 0;
+	size_t dlen = 0;
+	struct libdeflate_compressor *z = NULL;
+	bool single_member = false;
+	bgzip_stats_call stats;
+
+	if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+	  E("Null arguments not accepted");
+	  PG_RETURN_NULL();
+	}
+
+	compression_level = PG_GETARG_INT32(1);
+
+	/* compression level -1 is default best effort (approx 6) */
+	/* level 0 is no compression, 1-9 are lowest to highest */
+	if (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL)
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	if(PG_NARGS() == 3 && !PG_ARGISNULL(2))
+	  single_member = PG_GETARG_BOOL(2);
+
+	/* Not detoasted yet: several members can be compressed from slices of the input */
+	bgzip_source_init(&src, PG_GETARG_DATUM(0));
+	ilen = src.size;
+
+	/* Counted at the level asked for, even if the input turns out incompressible */
+	bgzip_stats_begin(&stats, BGZIP_FN_GZIP_COMPRESS, compression_level);
+
+	if (bgzip_max_threads > 1 && ilen > BGZIP_GZIP_CHUNK && !single_member) {
+	  bgzip_progress_start(BGZIP_FN_GZIP_COMPRESS, ilen, (ilen + BGZIP_GZIP_CHUNK - 1) / BGZIP_GZIP_CHUNK);
+	  compressed = bgzip_gzip_compress_parallel(&src, compression_level, bgzip_max_threads);
+	  /* blocks: gzip members */
+	  bgzip_stats_end(&stats, ilen, VARSIZE(compressed) - VARHDRSZ,
+			  (ilen + BGZIP_GZIP_CHUNK - 1) / BGZIP_GZIP_CHUNK);
+	  bgzip_progress_end();
+	  PG_RETURN_BYTEA_P(compressed);
+	}
+
+	/* A single member: libdeflate has no streaming interface, the whole input is needed at once */
+	uncompressed = (src.sliced) ? DatumGetByteaPP(src.datum) : src.content;
+	in = (const void*)(VARDATA_ANY(uncompressed));
+
+	/* Incompressible: stored blocks (level 0), without trying to deflate */
+	level = compression_level;
+	if (level != 0 && bgzip_is_incompressible((const uint8_t*)in, ilen)) {
+	  D1("gzip_compress: incompressible content, storing it");
+	  level = 0;
+	}
+
+	/* one libdeflate call: it cannot be interrupted, and shows as a single block in the progress */
+	bgzip_progress_start(BGZIP_FN_GZIP_COMPRESS, ilen, 1);
+	z = bgzip_get_compressor(level);
+
+	dlen = libdeflate_gzip_compress_bound(z, ilen); // worst case, stored blocks included
+	if (dlen + VARHDRSZ > MaxAllocSize)
+	  E("Compressed content could be too large: up to %zu bytes", dlen);
+	compressed = (bytea *)palloc(dlen + VARHDRSZ); 
+
+	// Raw deflate-gzip
+	if ( (dlen = bgzip_gzip_compress_timed(z, in, ilen, VARDATA(compressed), dlen)) <= 0) {
+	  W("libdeflate_gzip_compress failed");
+	  goto bailout;
+	}
+
+	compressed = (bytea *)repalloc(compressed, dlen + VARHDRSZ);
+	SET_VARSIZE(compressed, dlen + VARHDRSZ);
+	bgzip_stats_end(&stats, ilen, dlen, 1);
+	bgzip_progress_end();
+	PG_RETURN_BYTEA_P(compressed);
+
+bailout:
+
+	if(compressed) pfree(compressed);
+	PG_RETURN_NULL();
+}
+
+
+/*
+ * Multi-threaded decompression
+ *
+ * The block list is cut into contiguous runs, and each task inflates
+ * (and checks) a run of blocks at their final offsets.
+ */
+#define BGZIP_MAX_RUN 16 /* blocks, about 1MB */
+
+typedef struct bgzip_uncompress_job {
+  const uint8_t *in;
+  uint8_t *out;
+  const bgzf_block *blocks;
+  size_t nblocks;
+  size_t run;             /* blocks per task */
+  bool verify;
+  struct libdeflate_decompressor *d[BGZF_MAX_THREADS];
+} bgzip_uncompress_job;
+
+static int
+bgzip_uncompress_task(void *arg, size_t task, int worker)
+{
+  bgzip_uncompress_job *uj = (bgzip_uncompress_job *)arg;
+  size_t i = task * uj->run;
+  size_t end = i + uj->run;
+  int rc;
+
+  if (end > uj->nblocks) end = uj->nblocks;
+
+  for (; i < end; i++) {
+    const bgzf_block *b = &uj->blocks[i];
+    rc = bgzf_uncompress_block(uj->d[worker], uj->out + b->uoffset, uj->in + b->coffset, b, uj->verify);
+    if (rc)
+      return rc; /* the backend finds which block, to report it */
+  }
+  return 0;
+}
+
+/* Inflate all blocks into out, on nthreads threads. Reports errors itself, with offsets from base */
+static void
+bgzip_uncompress_parallel(uint8_t *out, const uint8_t *in,
+			  const bgzf_block *blocks, size_t nblocks,
+			  bool verify, int nthreads, size_t base)
+{
+  bgzip_uncompress_job uj;
+  bgzip_job job;
+  size_t ntasks, failed, i, end;
+  int rc, t;
+
+  uj.in = in;
+  uj.out = out;
+  uj.blocks = blocks;
+  uj.nblocks = nblocks;
+  uj.verify = verify;
+
+  /* A few runs per thread, to even out the load, and short enough to check for interrupts between them */
+  ntasks = (size_t)nthreads * 4;
+  if (ntasks > nblocks) ntasks = nblocks;
+  uj.run = (nblocks + ntasks - 1) / ntasks;
+  if (uj.run > BGZIP_MAX_RUN) uj.run = BGZIP_MAX_RUN;
+  ntasks = (nblocks + uj.run - 1) / uj.run;
+
+  memset(uj.d, 0, sizeof(uj.d));
+  uj.d[0] = bgzip_get_decompressor();
+  for (t = 1; t < nthreads; t++)
+    uj.d[t] = libdeflate_alloc_decompressor_ex(&libdeflate_job_options);
+
+  D1("Uncompressing %zu blocks in %zu runs with %d threads", nblocks, ntasks, nthreads);
+
+  bgzip_job_start(&job, nthreads, ntasks, bgzip_uncompress_task, &uj);
+  job.progress_unit = uj.run;
+  failed = bgzip_job_wait(&job);
+
+  for (t = 1; t < nthreads; t++)
+    libdeflate_free_decompressor(uj.d[t]);
+
+  if (failed == SIZE_MAX)
+    return;
+
+  /* Redo the lowest failed run here, to report its first bad block */
+  i = failed * uj.run;
+  end = Min(i + uj.run, nblocks);
+  for (; i < end; i++) {
+    rc = bgzf_uncompress_block(uj.d[0], out + blocks[i].uoffset, in + blocks[i].coffset, &blocks[i], verify);
+    if (rc == BGZF_BAD_CRC)
+      E("CRC mismatch in the block at offset %zu", base + blocks[i].coffset);
+    if (rc)
+      E("Error uncompressing the block at offset %zu", base + blocks[i].coffset);
+  }
+  E("Error uncompressing the blocks %zu to %zu", failed * uj.run, end - 1); /* not reached */
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_uncompress);
+Datum pg_bgzip_uncompress(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = NULL;
+	bytea* uncompressed = NULL;
+	const uint8_t* in = NULL;
+	size_t in_size = 0;
+	uint8_t* out = NULL;
+	bool verify = true;
+	bgzf_block *blocks = NULL;
+	size_t nblocks = 0, usize = 0, walked, i;
+	struct libdeflate_decompressor *d = NULL;
+	int rc, nthreads;
+	bgzip_stats_call stats;
+
+	if(PG_ARGISNULL(0)){
+	  E("Null arguments not accepted");
+	  PG_RETURN_NULL();
+	}
+
+	if(PG_NARGS() == 2 && !PG_ARGISNULL(1))
+	  verify = PG_GETARG_BOOL(1);
+
+	bgzip_stats_begin(&stats, BGZIP_FN_UNCOMPRESS, BGZIP_NO_LEVEL);
+
+	compressed = PG_GETARG_BYTEA_PP(0);
+	in = (const uint8_t*)(VARDATA_ANY(compressed));
+	in_size = VARSIZE_ANY_EXHDR(compressed);
+
+	/* Find the blocks, and the total uncompressed size, from the headers and footers */
+	walked = bgzf_walk(in, in_size, &blocks, &nblocks, &usize);
+	if (walked != in_size)
+	  E("Invalid BGZF block at offset %zu", walked);
+
+	if (usize + VARHDRSZ > MaxAllocSize)
+	  E("Uncompressed content too large: %zu bytes", usize);
+
+	/* Allocate the output once, and inflate each block in place */
+	uncompressed = (bytea *)palloc(usize + VARHDRSZ);
+	out = (uint8_t*)VARDATA(uncompressed);
+	bgzip_progress_start(BGZIP_FN_UNCOMPRESS, in_size, nblocks);
+
+	nthreads = (nblocks < (size_t)bgzip_max_threads) ? (int)nblocks : bgzip_max_threads;
+	if (nthreads > 1) {
+	  bgzip_uncompress_parallel(out, in, blocks, nblocks, verify, nthreads, 0);
+	} else {
+	  d = bgzip_get_decompressor();
+
+	  for (i = 0; i < nblocks; i++) {
+	    CHECK_FOR_INTERRUPTS();
+	    rc = bgzf_uncompress_block(d, out + blocks[i].uoffset, in + blocks[i].coffset, &blocks[i], verify);
+	    if (rc == BGZF_BAD_CRC)
+	      E("CRC mismatch in the block at offset %zu", blocks[i].coffset);
+	    if (rc)
+	      E("Error uncompressing the block at offset %zu", blocks[i].coffset);
+	    bgzip_progress_set(i + 1);
+	  }
+	}
+
+	if (blocks) pfree(blocks); /* none for empty content */
+
+	SET_VARSIZE(uncompressed, usize + VARHDRSZ);
+	bgzip_stats_end(&stats, in_size, usize, nblocks);
+	bgzip_progress_end();
+	PG_RETURN_BYTEA_P(uncompressed);
+}
+
+
+/*
+ * Integrity
+ *
+ * Every block is inflated and checked (CRC32, and ISIZE: libdeflate fails on any other
+ * output size), into a scratch buffer per thread that is reused from block to block:
+ * the uncompressed content is never held in memory. Runs of blocks as for bgzip.uncompress.
+ */
+typedef struct bgzip_verify_job {
+  const uint8_t *in;
+  const bgzf_block *blocks;
+  size_t nblocks;
+  size_t run;             /* blocks per task */
+  uint8_t *scratch;       /* BGZF_MAX_BLOCK_SIZE per worker */
+  struct libdeflate_decompressor *d[BGZF_MAX_THREADS];
+} bgzip_verify_job;
+
+static int
+bgzip_verify_task(void *arg, size_t task, int worker)
+{
+  bgzip_verify_job *vj = (bgzip_verify_job *)arg;
+  uint8_t *scratch = vj->scratch + (size_t)worker * BGZF_MAX_BLOCK_SIZE;
+  size_t i = task * vj->run;
+  size_t end = Min(i + vj->run, vj->nblocks);
+
+  for (; i < end; i++)
+    if (bgzf_uncompress_block(vj->d[worker], scratch, vj->in + vj->blocks[i].coffset, &vj->blocks[i], true))
+      return -1; /* the backend finds which block, and why */
+  return 0;
+}
+
+static const char *
+bgzip_verify_reason(int rc)
+{
+  switch (rc) {
+  case BGZF_BAD_CRC: return "CRC mismatch";
+  case BGZF_BAD_SIZE: return "ISIZE mismatch";
+  default: return "invalid deflate data";
+  }
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_verify);
+Datum pg_bgzip_verify(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = PG_GETARG_BYTEA_PP(0);
+	const uint8_t* in = (const uint8_t*)VARDATA_ANY(compressed);
+	size_t in_size = VARSIZE_ANY_EXHDR(compressed);
+	bgzf_block *blocks = NULL;
+	size_t nblocks = 0, usize = 0, walked, ntasks, failed, i, end;
+	size_t bad_offset = 0;
+	const char *reason = NULL;
+	bgzip_verify_job vj;
+	bgzip_job job;
+	int rc = 0, nthreads, t;
+	bgzip_stats_call stats;
+	TupleDesc tupdesc;
+	Datum values[3];
+	bool nulls[3] = { false, false, false };
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+	  E("Function returning record called in context that cannot accept type record");
+
+	bgzip_stats_begin(&stats, BGZIP_FN_VERIFY, BGZIP_NO_LEVEL);
+
+	/* The blocks before a structural error are still checked: one of them could fail first */
+	walked = bgzf_walk(in, in_size, &blocks, &nblocks, &usize);
+	bgzip_progress_start(BGZIP_FN_VERIFY, in_size, nblocks);
+
+	if (nblocks > 0) {
+	  nthreads = (nblocks < (size_t)bgzip_max_threads) ? (int)nblocks : bgzip_max_threads;
+
+	  vj.in = in;
+	  vj.blocks = blocks;
+	  vj.nblocks = nblocks;
+	  ntasks = Min((size_t)nthreads * 4, nblocks);
+	  vj.run = Min((nblocks + ntasks - 1) / ntasks, BGZIP_MAX_RUN);
+	  ntasks = (nblocks + vj.run - 1) / vj.run;
+
+	  memset(vj.d, 0, sizeof(vj.d));
+	  vj.d[0] = bgzip_get_decompressor();
+	  for (t = 1; t < nthreads; t++)
+	    vj.d[t] = libdeflate_alloc_decompressor_ex(&libdeflate_job_options);
+	  vj.scratch = (uint8_t*)palloc((size_t)nthreads * BGZF_MAX_BLOCK_SIZE);
+
+	  bgzip_job_start(&job, nthreads, ntasks, bgzip_verify_task, &vj);
+	  job.progress_unit = vj.run;
+	  failed = bgzip_job_wait(&job);
+
+	  for (t = 1; t < nthreads; t++)
+	    libdeflate_free_decompressor(vj.d[t]);
+
+	  /* Redo the lowest failed run here, to find its first bad block */
+	  if (failed != SIZE_MAX) {
+	    end = Min((failed + 1) * vj.run, nblocks);
+	    for (i = failed * vj.run; i < end && rc == 0; i++) {
+	      rc = bgzf_uncompress_block(vj.d[0], vj.scratch, in + blocks[i].coffset, &blocks[i], true);
+	      bad_offset = blocks[i].coffset;
+	    }
+	    reason = bgzip_verify_reason(rc);
+	  }
+
+	  pfree(vj.scratch);
+	  pfree(blocks);
+	}
+
+	if (!reason && walked != in_size) {
+	  bad_offset = walked;
+	  reason = "invalid block";
+	}
+
+	values[0] = BoolGetDatum(reason == NULL);
+	if (reason) {
+	  values[1] = Int64GetDatum((int64)bad_offset);
+	  values[2] = CStringGetTextDatum(reason);
+	} else {
+	  nulls[1] = true;
+	  nulls[2] = true;
+	}
+
+	bgzip_stats_end(&stats, in_size, usize, nblocks);
+	bgzip_progress_end();
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * Arrays
+ *
+ * One call for many small values: the compressors (or decompressors) are set up once,
+ * and the elements, rather than their blocks, are spread over the threads.
+ * The backend allocates each output beforehand, at its worst-case size, and the
+ * threads only fill them in. NULL elements stay NULL.
+ */
+typedef enum bgzip_array_op {
+  BGZIP_ARRAY_COMPRESS,
+  BGZIP_ARRAY_GZIP_COMPRESS,
+  BGZIP_ARRAY_UNCOMPRESS,
+} bgzip_array_op;
+
+typedef struct bgzip_array_job {
+  bgzip_array_op op;
+  bool with_eof;
+  bool verify;
+  const uint8_t **in;
+  size_t *in_size;
+  uint8_t **out;          /* allocated by the backend */
+  size_t *out_size;       /* capacity, then actual size */
+  bool *skip;             /* NULL, or already done by the backend */
+  bgzf_block **blocks;   /* uncompress only: walked by the backend */
+  size_t *nblocks;
+  size_t *bad_offset;     /* uncompress only: the block that failed, for the backend to report */
+  int *rc;
+  bgzip_compress_job cj;  /* for its compressors, stride and stored counter */
+  struct libdeflate_decompressor *d[BGZF_MAX_THREADS];
+} bgzip_array_job;
+
+static int
+bgzip_array_task(void *arg, size_t i, int worker)
+{
+  bgzip_array_job *aj = (bgzip_array_job *)arg;
+  const uint8_t *in = aj->in[i];
+  size_t in_size = aj->in_size[i];
+  uint8_t *out = aj->out[i];
+  size_t out_size = 0, dlen, b;
+  int rc = 0;
+
+  if (aj->skip[i])
+    return 0;
+
+  switch (aj->op) {
+
+  case BGZIP_ARRAY_COMPRESS:
+    while (in_size > 0) {
+      size_t isize = (in_size < BGZF_BLOCK_SIZE) ? in_size : BGZF_BLOCK_SIZE;
+      dlen = aj->cj.stride;
+      rc = bgzf_compress_block(aj->cj.z[worker], out + out_size, &dlen, in, isize, aj->cj.stored_entropy);
+      if (rc < 0)
+	break;
+      if (rc > 0)
+	atomic_fetch_add(&aj->cj.stored, 1);
+      rc = 0;
+      in += isize;
+      in_size -= isize;
+      out_size += dlen;
+    }
+    if (rc == 0 && aj->with_eof) {
+      memcpy(out + out_size, bgzf_eof_marker, BGZF_EOF_LENGTH);
+      out_size += BGZF_EOF_LENGTH;
+    }
+    break;
+
+  case BGZIP_ARRAY_GZIP_COMPRESS:
+    out_size = bgzip_gzip_compress_timed(aj->cj.z[worker], in, in_size, out, aj->out_size[i]);
+    if (out_size == 0)
+      rc = -1;
+    break;
+
+  case BGZIP_ARRAY_UNCOMPRESS:
+    for (b = 0; b < aj->nblocks[i]; b++) {
+      const bgzf_block *blk = &aj->blocks[i][b];
+      rc = bgzf_uncompress_block(aj->d[worker], out + blk->uoffset, in + blk->coffset, blk, aj->verify);
+      if (rc) {
+	aj->bad_offset[i] = blk->coffset;
+	break;
+      }
+    }
+    out_size = aj->out_size[i];
+    break;
+  }
+
+  /* only this worker touches element i: the backend reads it after the join */
+  aj->rc[i] = rc;
+  aj->out_size[i] = out_size;
+  return rc;
+}
+
+static Datum
+bgzip_array_apply(FunctionCallInfo fcinfo, bgzip_array_op op)
+{
+	ArrayType *array, *result;
+	Datum *elems;
+	bool *nulls;
+	int n, i, nthreads, todo = 0, level = -1;
+	bgzip_array_job aj;
+	bgzip_job job;
+	size_t failed, usize, walked, total_blocks = 0;
+	uint64 total_in = 0, total_out = 0;
+	bytea **outputs;
+	bgzip_stats_call stats;
+	static const bgzip_stats_fn stats_fn[] = { BGZIP_FN_COMPRESS, BGZIP_FN_GZIP_COMPRESS, BGZIP_FN_UNCOMPRESS };
+
+	if(PG_ARGISNULL(0)){
+	  E("Null arguments not accepted");
+	  PG_RETURN_NULL();
+	}
+
+	memset(&aj, 0, sizeof(aj));
+	aj.op = op;
+	aj.verify = true;
+
+	if (op == BGZIP_ARRAY_UNCOMPRESS) {
+	  if(PG_NARGS() >= 2 && !PG_ARGISNULL(1))
+	    aj.verify = PG_GETARG_BOOL(1);
+	} else {
+	  if(PG_NARGS() < 2 || PG_ARGISNULL(1))
+	    E("Null arguments not accepted");
+	  level = PG_GETARG_INT32(1);
+	  if (level < -1 || level > BGZIP_MAX_LEVEL)
+	    elog(ERROR, "invalid compression level: %d", level);
+	  if(op == BGZIP_ARRAY_COMPRESS && PG_NARGS() == 3 && !PG_ARGISNULL(2))
+	    aj.with_eof = PG_GETARG_BOOL(2);
+	}
+
+	bgzip_stats_begin(&stats, stats_fn[op], (op == BGZIP_ARRAY_UNCOMPRESS) ? BGZIP_NO_LEVEL : level);
+
+	array = PG_GETARG_ARRAYTYPE_P(0);
+	if (ARR_NDIM(array) == 0)
+	  PG_RETURN_ARRAYTYPE_P(construct_empty_array(BYTEAOID));
+
+	deconstruct_array(array, BYTEAOID, -1, false, TYPALIGN_INT, &elems, &nulls, &n);
+
+	aj.in = (const uint8_t **)palloc0(n * sizeof(uint8_t *));
+	aj.in_size = (size_t *)palloc0(n * sizeof(size_t));
+	aj.out = (uint8_t **)palloc0(n * sizeof(uint8_t *));
+	aj.out_size = (size_t *)palloc0(n * sizeof(size_t));
+	aj.skip = (bool *)palloc0(n * sizeof(bool));
+	aj.rc = (int *)palloc0(n * sizeof(int));
+	outputs = (bytea **)palloc0(n * sizeof(bytea *));
+	if (op == BGZIP_ARRAY_UNCOMPRESS) {
+	  aj.blocks = (bgzf_block **)palloc0(n * sizeof(bgzf_block *));
+	  aj.nblocks = (size_t *)palloc0(n * sizeof(size_t));
+	  aj.bad_offset = (size_t *)palloc0(n * sizeof(size_t));
+	} else {
+	  aj.cj.stride = bgzf_block_bound(bgzip_get_compressor(level));
+	}
+
+	/* Everything Postgres-related happens here, before the threads start */
+	for (i = 0; i < n; i++) {
+	  bytea *v;
+	  size_t capacity = 0;
+
+	  if (nulls[i]) {
+	    aj.skip[i] = true;
+	    continue;
+	  }
+
+	  v = DatumGetByteaPP(elems[i]);
+	  aj.in[i] = (const uint8_t *)VARDATA_ANY(v);
+	  aj.in_size[i] = VARSIZE_ANY_EXHDR(v);
+	  total_in += aj.in_size[i];
+
+	  switch (op) {
+	  case BGZIP_ARRAY_COMPRESS:
+	    capacity = (aj.in_size[i] + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE * aj.cj.stride + BGZF_EOF_LENGTH;
+	    total_blocks += (aj.in_size[i] + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+	    break;
+
+	  case BGZIP_ARRAY_GZIP_COMPRESS:
+	    if (level != 0 && bgzip_is_incompressible(aj.in[i], aj.in_size[i])) {
+	      /* stored here, with the level 0 compressor, so the threads all use the same level */
+	      struct libdeflate_compressor *z0 = bgzip_get_compressor(0);
+	      capacity = libdeflate_gzip_compress_bound(z0, aj.in_size[i]);
+	      if (capacity + VARHDRSZ > MaxAllocSize)
+		E("Compressed element %d could be too large: up to %zu bytes", i + 1, capacity);
+	      outputs[i] = (bytea *)palloc(capacity + VARHDRSZ);
+	      aj.out_size[i] = bgzip_gzip_compress_timed(z0, aj.in[i], aj.in_size[i], VARDATA(outputs[i]), capacity);
+	      if (aj.out_size[i] == 0)
+		E("Error compressing the element %d", i + 1);
+	      aj.skip[i] = true;
+	      continue;
+	    }
+	    capacity = libdeflate_gzip_compress_bound(bgzip_get_compressor(level), aj.in_size[i]);
+	    break;
+
+	  case BGZIP_ARRAY_UNCOMPRESS:
+	    walked = bgzf_walk(aj.in[i], aj.in_size[i], &aj.blocks[i], &aj.nblocks[i], &usize);
+	    if (walked != aj.in_size[i])
+	      E("Invalid BGZF block at offset %zu of the element %d", walked, i + 1);
+	    capacity = usize;
+	    total_blocks += aj.nblocks[i];
+	    break;
+	  }
+
+	  if (capacity + VARHDRSZ > MaxAllocSize)
+	    E("Element %d could be too large: up to %zu bytes", i + 1, capacity);
+	  outputs[i] = (bytea *)palloc(capacity + VARHDRSZ);
+	  aj.out[i] = (uint8_t *)VARDATA(outputs[i]);
+	  aj.out_size[i] = capacity;
+	  todo++;
+	}
+
+	nthreads = (todo < bgzip_max_threads) ? todo : bgzip_max_threads;
+	if (nthreads < 1) nthreads = 1;
+
+	/* progress in elements */
+	bgzip_progress_start(stats_fn[op], total_in, (uint64)n);
+
+	if (op == BGZIP_ARRAY_UNCOMPRESS) {
+	  aj.d[0] = bgzip_get_decompressor();
+	  for (i = 1; i < nthreads; i++)
+	    aj.d[i] = libdeflate_alloc_decompressor_ex(&libdeflate_job_options);
+	} else {
+	  bgzip_compress_job_init(&aj.cj, level, nthreads);
+	}
+
+	D1("Processing %d elements (%d to do) with %d threads", n, todo, nthreads);
+
+	bgzip_job_start(&job, nthreads, (size_t)n, bgzip_array_task, &aj);
+	failed = bgzip_job_wait(&job);
+
+	if (op == BGZIP_ARRAY_UNCOMPRESS) {
+	  for (i = 1; i < nthreads; i++)
+	    libdeflate_free_decompressor(aj.d[i]);
+	} else {
+	  bgzip_compress_job_free(&aj.cj);
+	}
+
+	if (failed != SIZE_MAX) {
+	  if (aj.rc[failed] == BGZF_BAD_CRC)
+	    E("CRC mismatch in the block at offset %zu of the element %zu", aj.bad_offset[failed], failed + 1);
+	  if (op == BGZIP_ARRAY_UNCOMPRESS)
+	    E("Error uncompressing the block at offset %zu of the element %zu", aj.bad_offset[failed], failed + 1);
+	  E("Error compressing the element %zu", failed + 1);
+	}
+
+	if (op == BGZIP_ARRAY_COMPRESS) {
+	  bgzip_last_call_reset();
+	  bgzip_last_call.blocks = total_blocks;
+	  bgzip_last_call.stored_blocks = atomic_load(&aj.cj.stored);
+	}
+
+	for (i = 0; i < n; i++) {
+	  if (nulls[i]) continue;
+	  SET_VARSIZE(outputs[i], aj.out_size[i] + VARHDRSZ);
+	  elems[i] = PointerGetDatum(outputs[i]);
+	  total_out += aj.out_size[i];
+	  if (op == BGZIP_ARRAY_GZIP_COMPRESS) total_blocks++;
+	}
+	bgzip_stats_end(&stats, total_in, total_out, total_blocks);
+	bgzip_progress_end();
+
+	result = construct_md_array(elems, nulls, ARR_NDIM(array), ARR_DIMS(array), ARR_LBOUND(array),
+				    BYTEAOID, -1, false, TYPALIGN_INT);
+	PG_RETURN_ARRAYTYPE_P(result);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_array);
+Datum pg_bgzip_compress_array(PG_FUNCTION_ARGS)
+{
+	return bgzip_array_apply(fcinfo, BGZIP_ARRAY_COMPRESS);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_gzip_compress_array);
+Datum pg_bgzip_gzip_compress_array(PG_FUNCTION_ARGS)
+{
+	return bgzip_array_apply(fcinfo, BGZIP_ARRAY_GZIP_COMPRESS);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_uncompress_array);
+Datum pg_bgzip_uncompress_array(PG_FUNCTION_ARGS)
+{
+	return bgzip_array_apply(fcinfo, BGZIP_ARRAY_UNCOMPRESS);
+}
+
+
+/*
+ * Streaming aggregate
+ *
+ * The transition state holds only a partial input block, and the compressed output so far:
+ * each block is compressed as soon as it is full. The final function compresses the tail,
+ * and adds the EOF marker.
+ * The output is kept as a bytea (with its header room), so the final function can return it as is.
+ */
+typedef struct bgzip_agg_state {
+  int level;
+  size_t stride;          /* bound of a compressed block */
+  bytea *out;             /* in the aggregate context */
+  size_t out_size;        /* compressed bytes in out */
+  size_t out_capacity;    /* room for that many compressed bytes */
+  size_t tail_size;
+  uint8_t tail[BGZF_BLOCK_SIZE];
+} bgzip_agg_state;
+
+static void
+bgzip_agg_reserve(bgzip_agg_state *state, size_t size)
+{
+  if (state->out_size + size <= state->out_capacity)
+    return;
+
+  while (state->out_size + size > state->out_capacity)
+    state->out_capacity *= 2;
+
+  if (state->out_capacity + VARHDRSZ > MaxAllocSize)
+    E("Compressed content too large: more than %zu bytes", state->out_size);
+
+  state->out = (bytea *)repalloc(state->out, state->out_capacity + VARHDRSZ); /* same context */
+}
+
+static void
+bgzip_agg_compress_block(bgzip_agg_state *state, const uint8_t *src, size_t slen)
+{
+  size_t dlen = state->stride;
+  int rc;
+
+  bgzip_agg_reserve(state, dlen);
+
+  /* not kept in the state: the cache could be flushed in between */
+  rc = bgzf_compress_block(bgzip_get_compressor(state->level),
+				(uint8_t*)VARDATA(state->out) + state->out_size, &dlen, src, slen,
+				bgzip_block_entropy());
+  if (rc < 0)
+    E("Error compressing the block at position %zu", state->out_size);
+
+  bgzip_last_call.blocks++;
+  bgzip_last_call.stored_blocks += rc;
+
+  state->out_size += dlen;
+}
+
+static void
+bgzip_agg_add(bgzip_agg_state *state, const uint8_t *in, size_t in_size)
+{
+  while (in_size > 0) {
+    size_t n;
+
+    /* full blocks straight from the input */
+    if (state->tail_size == 0 && in_size >= BGZF_BLOCK_SIZE) {
+      bgzip_agg_compress_block(state, in, BGZF_BLOCK_SIZE);
+      in += BGZF_BLOCK_SIZE;
+      in_size -= BGZF_BLOCK_SIZE;
+      continue;
+    }
+
+    n = Min(in_size, BGZF_BLOCK_SIZE - state->tail_size);
+    memcpy(state->tail + state->tail_size, in, n);
+    state->tail_size += n;
+    in += n;
+    in_size -= n;
+
+    if (state->tail_size == BGZF_BLOCK_SIZE) {
+      bgzip_agg_compress_block(state, state->tail, BGZF_BLOCK_SIZE);
+      state->tail_size = 0;
+    }
+  }
+}
+
+static bgzip_agg_state *
+bgzip_agg_state_create(MemoryContext aggcontext, int level)
+{
+  bgzip_agg_state *state;
+
+  if (level < -1 || level > BGZIP_MAX_LEVEL)
+    elog(ERROR, "invalid compression level: %d", level);
+
+  bgzip_last_call_reset();
+
+  state = (bgzip_agg_state *)MemoryContextAlloc(aggcontext, sizeof(bgzip_agg_state));
+  state->level = level;
+  state->stride = bgzf_block_bound(bgzip_get_compressor(level));
+  state->out_capacity = 4 * state->stride;
+  state->out = (bytea *)MemoryContextAlloc(aggcontext, state->out_capacity + VARHDRSZ);
+  state->out_size = 0;
+  state->tail_size = 0;
+  return state;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_agg_transfn);
+Datum pg_bgzip_compress_agg_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_agg_state *state;
+	bytea *content;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.compress_agg called in non-aggregate context");
+
+	if (PG_ARGISNULL(0)) {
+	  int level = 9; /* same default as bgzip.compress */
+	  if (PG_NARGS() == 3 && !PG_ARGISNULL(2))
+	    level = PG_GETARG_INT32(2);
+	  state = bgzip_agg_state_create(aggcontext, level);
+	}
+	else
+	  state = (bgzip_agg_state *)PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1)) {
+	  content = PG_GETARG_BYTEA_PP(1);
+	  bgzip_agg_add(state, (const uint8_t*)VARDATA_ANY(content), VARSIZE_ANY_EXHDR(content));
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_agg_finalfn);
+Datum pg_bgzip_compress_agg_finalfn(PG_FUNCTION_ARGS)
+{
+	bgzip_agg_state *state;
+
+	if (PG_ARGISNULL(0))
+	  PG_RETURN_NULL(); /* no rows */
+
+	state = (bgzip_agg_state *)PG_GETARG_POINTER(0);
+
+	if (state->tail_size > 0) {
+	  bgzip_agg_compress_block(state, state->tail, state->tail_size);
+	  state->tail_size = 0;
+	}
+
+	/* Add the EOF marker */
+	bgzip_agg_reserve(state, BGZF_EOF_LENGTH);
+	memcpy((uint8_t*)VARDATA(state->out) + state->out_size, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	state->out_size += BGZF_EOF_LENGTH;
+
+	SET_VARSIZE(state->out, state->out_size + VARHDRSZ);
+	PG_RETURN_BYTEA_P(state->out);
+}
+
+/*
+ * Parallel aggregation
+ *
+ * BGZF members are concatenable: a worker's compressed blocks are appended as is.
+ * Only the leader's partial tail gets compressed as a short block, when the worker
+ * brings blocks of its own, since the worker's tail cannot go before them.
+ * The EOF marker is only added by the final function.
+ *
+ * Serialized state: int32 level, uint32 tail size, the tail, then the compressed blocks.
+ */
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_agg_serialfn);
+Datum pg_bgzip_compress_agg_serialfn(PG_FUNCTION_ARGS)
+{
+	bgzip_agg_state *state;
+	bytea *result;
+	uint8_t *p;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	  E("bgzip.compress_agg_serialfn called in non-aggregate context");
+
+	state = (bgzip_agg_state *)PG_GETARG_POINTER(0);
+
+	result = (bytea *)palloc(VARHDRSZ + 8 + state->tail_size + state->out_size);
+	SET_VARSIZE(result, VARHDRSZ + 8 + state->tail_size + state->out_size);
+	p = (uint8_t*)VARDATA(result);
+	packInt32(p, (uint32_t)state->level);
+	packInt32(p + 4, (uint32_t)state->tail_size);
+	memcpy(p + 8, state->tail, state->tail_size);
+	memcpy(p + 8 + state->tail_size, VARDATA(state->out), state->out_size);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_agg_deserialfn);
+Datum pg_bgzip_compress_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_agg_state *state;
+	bytea *serialized;
+	const uint8_t *p;
+	size_t len, tail_size;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.compress_agg_deserialfn called in non-aggregate context");
+
+	serialized = PG_GETARG_BYTEA_PP(0);
+	p = (const uint8_t*)VARDATA_ANY(serialized);
+	len = VARSIZE_ANY_EXHDR(serialized);
+
+	if (len < 8 || (tail_size = unpackInt32(p + 4)) > BGZF_BLOCK_SIZE || 8 + tail_size > len)
+	  E("Invalid serialized bgzip.compress_agg state");
+
+	state = bgzip_agg_state_create(aggcontext, (int32)unpackInt32(p));
+	state->tail_size = tail_size;
+	memcpy(state->tail, p + 8, tail_size);
+
+	len -= 8 + tail_size;
+	bgzip_agg_reserve(state, len);
+	memcpy(VARDATA(state->out), p + 8 + tail_size, len);
+	state->out_size = len;
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_agg_combinefn);
+Datum pg_bgzip_compress_agg_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_agg_state *state1 = NULL;
+	bgzip_agg_state *state2;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.compress_agg_combinefn called in non-aggregate context");
+
+	if (PG_ARGISNULL(1)) {
+	  if (PG_ARGISNULL(0))
+	    PG_RETURN_NULL();
+	  PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	state2 = (bgzip_agg_state *)PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+	  state1 = bgzip_agg_state_create(aggcontext, state2->level); /* copy state2 in our context */
+	else
+	  state1 = (bgzip_agg_state *)PG_GETARG_POINTER(0);
+
+	if (state2->out_size > 0) {
+	  /* flush our tail as a short block, and take the other blocks as they are */
+	  if (state1->tail_size > 0) {
+	    bgzip_agg_compress_block(state1, state1->tail, state1->tail_size);
+	    state1->tail_size = 0;
+	  }
+	  bgzip_agg_reserve(state1, state2->out_size);
+	  memcpy((uint8_t*)VARDATA(state1->out) + state1->out_size, VARDATA(state2->out), state2->out_size);
+	  state1->out_size += state2->out_size;
+	}
+
+	/* the other tail continues ours */
+	bgzip_agg_add(state1, state2->tail, state2->tail_size);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * Concatenation
+ *
+ * BGZF values concatenate as they are: the blocks are copied, never inflated.
+ * Each value is walked first, so that garbage does not end up in the middle of the result,
+ * and its empty blocks (EOF markers) are left out: at most one goes at the very end.
+ * By default, there is one there when the last value ended with one.
+ */
+#define BGZIP_CONCAT_EOF_AUTO -1
+
+static bool
+bgzip_ends_with_eof(const uint8_t *in, size_t in_size)
+{
+  return in_size >= BGZF_EOF_LENGTH &&
+    memcmp(in + in_size - BGZF_EOF_LENGTH, bgzf_eof_marker, BGZF_EOF_LENGTH) == 0;
+}
+
+/* Size of the data blocks of the value. *walked is less than in_size on an invalid block */
+static size_t
+bgzip_concat_size(const uint8_t *in, size_t in_size, size_t *walked)
+{
+  bgzf_block b;
+  size_t coffset = 0, size = 0;
+
+  while (coffset < in_size) {
+    if (bgzf_parse_block(in + coffset, in_size - coffset, &b))
+      break;
+    if (!bgzf_is_eof_block(&b))
+      size += b.csize;
+    coffset += b.csize;
+  }
+  *walked = coffset;
+  return size;
+}
+
+/* Copy the data blocks of a value checked by bgzip_concat_size, in runs between the empty blocks */
+static size_t
+bgzip_concat_copy(uint8_t *dst, const uint8_t *in, size_t in_size)
+{
+  bgzf_block b;
+  size_t coffset = 0, start = 0, written = 0;
+
+  while (coffset < in_size) {
+    bgzf_parse_block(in + coffset, in_size - coffset, &b); /* already checked */
+    if (bgzf_is_eof_block(&b)) {
+      memcpy(dst + written, in + start, coffset - start);
+      written += coffset - start;
+      start = coffset + b.csize;
+    }
+    coffset += b.csize;
+  }
+  memcpy(dst + written, in + start, in_size - start);
+  return written + in_size - start;
+}
+
+/* bgzip.concat([eof,] VARIADIC contents) */
+PG_FUNCTION_INFO_V1(pg_bgzip_concat);
+Datum pg_bgzip_concat(PG_FUNCTION_ARGS)
+{
+	int eof = BGZIP_CONCAT_EOF_AUTO;
+	ArrayType *array;
+	Datum *elems = NULL;
+	bool *nulls = NULL;
+	bytea **values;
+	bytea *result;
+	size_t total = 0, size, walked, out_size = 0;
+	bool last_eof = false;
+	int n = 0, i;
+
+	if (PG_NARGS() == 2) {
+	  eof = PG_GETARG_BOOL(0);
+	  array = PG_GETARG_ARRAYTYPE_P(1);
+	} else
+	  array = PG_GETARG_ARRAYTYPE_P(0);
+
+	if (ARR_NDIM(array) > 0)
+	  deconstruct_array(array, BYTEAOID, -1, false, TYPALIGN_INT, &elems, &nulls, &n);
+
+	/* Check everything before allocating */
+	values = (bytea **)palloc0(Max(n, 1) * sizeof(bytea *));
+	for (i = 0; i < n; i++) {
+	  if (nulls[i])
+	    continue;
+	  values[i] = DatumGetByteaPP(elems[i]);
+	  size = bgzip_concat_size((const uint8_t*)VARDATA_ANY(values[i]), VARSIZE_ANY_EXHDR(values[i]), &walked);
+	  if (walked != VARSIZE_ANY_EXHDR(values[i]))
+	    E("Invalid BGZF block at offset %zu of the value %d", walked, i + 1);
+	  total += size;
+	  last_eof = bgzip_ends_with_eof((const uint8_t*)VARDATA_ANY(values[i]), VARSIZE_ANY_EXHDR(values[i]));
+	}
+	if (eof == BGZIP_CONCAT_EOF_AUTO)
+	  eof = last_eof;
+	if (eof)
+	  total += BGZF_EOF_LENGTH;
+
+	if (total + VARHDRSZ > MaxAllocSize)
+	  E("Concatenated content too large: %zu bytes", total);
+
+	result = (bytea *)palloc(total + VARHDRSZ);
+	for (i = 0; i < n; i++)
+	  if (values[i])
+	    out_size += bgzip_concat_copy((uint8_t*)VARDATA(result) + out_size,
+					  (const uint8_t*)VARDATA_ANY(values[i]), VARSIZE_ANY_EXHDR(values[i]));
+	if (eof) {
+	  memcpy((uint8_t*)VARDATA(result) + out_size, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	  out_size += BGZF_EOF_LENGTH;
+	}
+	Assert(out_size == total);
+
+	SET_VARSIZE(result, out_size + VARHDRSZ);
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * Appending: only the last data block changes, when it is short. It is inflated, and compressed
+ * again with the new data; all the blocks before it are kept as they are.
+ * The EOF marker stays at the end, if there was one.
+ */
+PG_FUNCTION_INFO_V1(pg_bgzip_append);
+Datum pg_bgzip_append(PG_FUNCTION_ARGS)
+{
+	Size start_memory = MemoryContextMemAllocated(CurrentMemoryContext, true);
+	bytea *existing = PG_GETARG_BYTEA_PP(0);
+	bytea *data = PG_GETARG_BYTEA_PP(1);
+	int32 compression_level = PG_GETARG_INT32(2);
+	const uint8_t *in = (const uint8_t*)VARDATA_ANY(existing);
+	size_t in_size = VARSIZE_ANY_EXHDR(existing);
+	size_t data_size = VARSIZE_ANY_EXHDR(data);
+	bgzf_block *blocks = NULL;
+	size_t nblocks = 0, usize = 0, walked, keep = 0, tail_size = 0, last, result_size;
+	bool with_eof;
+	bytea *tail, *compressed, *result;
+	bgzip_source src;
+	int rc;
+
+	if (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL)
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	walked = bgzf_walk(in, in_size, &blocks, &nblocks, &usize);
+	if (walked != in_size)
+	  E("Invalid BGZF block at offset %zu", walked);
+
+	if (data_size == 0) {
+	  if (blocks) pfree(blocks);
+	  PG_RETURN_BYTEA_P(existing);
+	}
+
+	with_eof = bgzip_ends_with_eof(in, in_size);
+
+	/* The last data block, before the trailing empty blocks */
+	for (last = nblocks; last > 0 && bgzf_is_eof_block(&blocks[last - 1]); last--)
+	  ;
+	if (last > 0)
+	  keep = blocks[last - 1].coffset + blocks[last - 1].csize;
+
+	if (data_size + BGZF_BLOCK_SIZE + VARHDRSZ > MaxAllocSize)
+	  E("Appended content too large: %zu bytes", data_size);
+	tail = (bytea *)palloc(data_size + BGZF_BLOCK_SIZE + VARHDRSZ);
+
+	if (last > 0 && blocks[last - 1].usize < BGZF_BLOCK_SIZE) {
+	  const bgzf_block *b = &blocks[last - 1];
+
+	  rc = bgzf_uncompress_block(bgzip_get_decompressor(), (uint8_t*)VARDATA(tail), in + b->coffset, b, true);
+	  if (rc == BGZF_BAD_CRC)
+	    E("CRC mismatch in the block at offset %zu", b->coffset);
+	  if (rc)
+	    E("Error uncompressing the block at offset %zu", b->coffset);
+	  tail_size = b->usize;
+	  keep = b->coffset;
+	}
+	if (blocks) pfree(blocks);
+
+	memcpy((uint8_t*)VARDATA(tail) + tail_size, VARDATA_ANY(data), data_size);
+	SET_VARSIZE(tail, tail_size + data_size + VARHDRSZ);
+
+	bgzip_source_init(&src, PointerGetDatum(tail));
+	compressed = bgzip_compress_content(&src, compression_level, false, NULL, start_memory);
+	pfree(tail);
+
+	result_size = keep + VARSIZE(compressed) - VARHDRSZ + ((with_eof) ? BGZF_EOF_LENGTH : 0);
+	if (result_size + VARHDRSZ > MaxAllocSize)
+	  E("Compressed content too large: %zu bytes", result_size);
+
+	result = (bytea *)palloc(result_size + VARHDRSZ);
+	memcpy(VARDATA(result), in, keep);
+	memcpy((uint8_t*)VARDATA(result) + keep, VARDATA(compressed), VARSIZE(compressed) - VARHDRSZ);
+	if (with_eof)
+	  memcpy((uint8_t*)VARDATA(result) + result_size - BGZF_EOF_LENGTH, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	pfree(compressed);
+
+	SET_VARSIZE(result, result_size + VARHDRSZ);
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * The aggregate keeps the blocks so far in a bytea (with its header room), as bgzip.compress_agg.
+ * In parallel, a worker's blocks simply follow the leader's.
+ * Serialized state: int32 eof, uint32 last_eof, then the blocks.
+ */
+typedef struct bgzip_concat_state {
+  int eof;                /* requested, or BGZIP_CONCAT_EOF_AUTO */
+  bool last_eof;          /* the last value ended with the EOF marker */
+  bytea *out;             /* in the aggregate context */
+  size_t out_size;
+  size_t out_capacity;
+} bgzip_concat_state;
+
+static void
+bgzip_concat_reserve(bgzip_concat_state *state, size_t size)
+{
+  if (state->out_size + size <= state->out_capacity)
+    return;
+
+  while (state->out_size + size > state->out_capacity)
+    state->out_capacity *= 2;
+
+  if (state->out_capacity + VARHDRSZ > MaxAllocSize)
+    E("Concatenated content too large: more than %zu bytes", state->out_size);
+
+  state->out = (bytea *)repalloc(state->out, state->out_capacity + VARHDRSZ); /* same context */
+}
+
+static bgzip_concat_state *
+bgzip_concat_state_create(MemoryContext aggcontext, int eof)
+{
+  bgzip_concat_state *state;
+
+  state = (bgzip_concat_state *)MemoryContextAlloc(aggcontext, sizeof(bgzip_concat_state));
+  state->eof = eof;
+  state->last_eof = false;
+  state->out_capacity = BGZF_MAX_BLOCK_SIZE;
+  state->out = (bytea *)MemoryContextAlloc(aggcontext, state->out_capacity + VARHDRSZ);
+  state->out_size = 0;
+  return state;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_concat_agg_transfn);
+Datum pg_bgzip_concat_agg_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_concat_state *state;
+	bytea *content;
+	const uint8_t *in;
+	size_t in_size, size, walked;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.concat_agg called in non-aggregate context");
+
+	if (PG_ARGISNULL(0)) {
+	  int eof = BGZIP_CONCAT_EOF_AUTO;
+	  if (PG_NARGS() == 3 && !PG_ARGISNULL(2))
+	    eof = PG_GETARG_BOOL(2);
+	  state = bgzip_concat_state_create(aggcontext, eof);
+	}
+	else
+	  state = (bgzip_concat_state *)PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1)) {
+	  content = PG_GETARG_BYTEA_PP(1);
+	  in = (const uint8_t*)VARDATA_ANY(content);
+	  in_size = VARSIZE_ANY_EXHDR(content);
+
+	  size = bgzip_concat_size(in, in_size, &walked);
+	  if (walked != in_size)
+	    E("Invalid BGZF block at offset %zu", walked);
+
+	  bgzip_concat_reserve(state, size);
+	  state->out_size += bgzip_concat_copy((uint8_t*)VARDATA(state->out) + state->out_size, in, in_size);
+	  state->last_eof = bgzip_ends_with_eof(in, in_size);
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_concat_agg_finalfn);
+Datum pg_bgzip_concat_agg_finalfn(PG_FUNCTION_ARGS)
+{
+	bgzip_concat_state *state;
+
+	if (PG_ARGISNULL(0))
+	  PG_RETURN_NULL(); /* no rows */
+
+	state = (bgzip_concat_state *)PG_GETARG_POINTER(0);
+
+	if ((state->eof == BGZIP_CONCAT_EOF_AUTO) ? state->last_eof : state->eof) {
+	  bgzip_concat_reserve(state, BGZF_EOF_LENGTH);
+	  memcpy((uint8_t*)VARDATA(state->out) + state->out_size, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	  state->out_size += BGZF_EOF_LENGTH;
+	}
+
+	SET_VARSIZE(state->out, state->out_size + VARHDRSZ);
+	PG_RETURN_BYTEA_P(state->out);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_concat_agg_serialfn);
+Datum pg_bgzip_concat_agg_serialfn(PG_FUNCTION_ARGS)
+{
+	bgzip_concat_state *state;
+	bytea *result;
+	uint8_t *p;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	  E("bgzip.concat_agg_serialfn called in non-aggregate context");
+
+	state = (bgzip_concat_state *)PG_GETARG_POINTER(0);
+
+	result = (bytea *)palloc(VARHDRSZ + 8 + state->out_size);
+	SET_VARSIZE(result, VARHDRSZ + 8 + state->out_size);
+	p = (uint8_t*)VARDATA(result);
+	packInt32(p, (uint32_t)state->eof);
+	packInt32(p + 4, (uint32_t)state->last_eof);
+	memcpy(p + 8, VARDATA(state->out), state->out_size);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_concat_agg_deserialfn);
+Datum pg_bgzip_concat_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_concat_state *state;
+	bytea *serialized;
+	const uint8_t *p;
+	size_t len;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.concat_agg_deserialfn called in non-aggregate context");
+
+	serialized = PG_GETARG_BYTEA_PP(0);
+	p = (const uint8_t*)VARDATA_ANY(serialized);
+	len = VARSIZE_ANY_EXHDR(serialized);
+
+	if (len < 8)
+	  E("Invalid serialized bgzip.concat_agg state");
+
+	state = bgzip_concat_state_create(aggcontext, (int32)unpackInt32(p));
+	state->last_eof = unpackInt32(p + 4) != 0;
+
+	len -= 8;
+	bgzip_concat_reserve(state, len);
+	memcpy(VARDATA(state->out), p + 8, len);
+	state->out_size = len;
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_concat_agg_combinefn);
+Datum pg_bgzip_concat_agg_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	bgzip_concat_state *state1;
+	bgzip_concat_state *state2;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+	  E("bgzip.concat_agg_combinefn called in non-aggregate context");
+
+	if (PG_ARGISNULL(1)) {
+	  if (PG_ARGISNULL(0))
+	    PG_RETURN_NULL();
+	  PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	state2 = (bgzip_concat_state *)PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+	  state1 = bgzip_concat_state_create(aggcontext, state2->eof); /* copy state2 in our context */
+	else
+	  state1 = (bgzip_concat_state *)PG_GETARG_POINTER(0);
+
+	bgzip_concat_reserve(state1, state2->out_size);
+	memcpy((uint8_t*)VARDATA(state1->out) + state1->out_size, VARDATA(state2->out), state2->out_size);
+	state1->out_size += state2->out_size;
+	if (state2->out_size > 0 || state2->last_eof)
+	  state1->last_eof = state2->last_eof;
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * Random access
+ *
+ * Read length uncompressed bytes, skipping the first skip bytes of the block at coffset.
+ * Only the headers and footers are walked to find the blocks that hold the range,
+ * and only those blocks are inflated.
+ * The result is cut short if the content ends before the range does.
+ */
+static bytea *
+bgzip_read_range(const uint8_t *in, size_t in_size,
+		 size_t coffset, size_t skip, size_t length)
+{
+  bgzf_block b;
+  size_t first, end, avail = 0, written = 0;
+  bytea *result;
+  uint8_t *out, *scratch = NULL;
+  struct libdeflate_decompressor *d;
+  int rc;
+
+  /* Find the first block */
+  while (coffset < in_size) {
+    if (bgzf_parse_block(in + coffset, in_size - coffset, &b))
+      E("Invalid BGZF block at offset %zu", coffset);
+    if (skip < b.usize)
+      break;
+    skip -= b.usize;
+    coffset += b.csize;
+  }
+  first = end = coffset;
+
+  /* and how far the range goes */
+  while (end < in_size && avail < skip + length) {
+    if (bgzf_parse_block(in + end, in_size - end, &b))
+      E("Invalid BGZF block at offset %zu", end);
+    avail += b.usize;
+    end += b.csize;
+  }
+  if (avail < skip + length)
+    length = (avail > skip) ? avail - skip : 0;
+
+  if (length + VARHDRSZ > MaxAllocSize)
+    E("Range too large: %zu bytes", length);
+
+  result = (bytea *)palloc(length + VARHDRSZ);
+  SET_VARSIZE(result, length + VARHDRSZ);
+  out = (uint8_t*)VARDATA(result);
+  d = bgzip_get_decompressor();
+
+  for (coffset = first; written < length; coffset += b.csize) {
+
+    CHECK_FOR_INTERRUPTS();
+    bgzf_parse_block(in + coffset, in_size - coffset, &b); /* already checked */
+
+    if (skip == 0 && b.usize <= length - written) {
+      /* whole block: straight into the result */
+      rc = bgzf_uncompress_block(d, out + written, in + coffset, &b, true);
+      written += b.usize;
+    } else {
+      /* partial block: through a scratch buffer */
+      size_t n = Min(b.usize - skip, length - written);
+      if (!scratch) scratch = (uint8_t*)palloc(BGZF_MAX_BLOCK_SIZE);
+      rc = bgzf_uncompress_block(d, scratch, in + coffset, &b, true);
+      if (rc == 0) memcpy(out + written, scratch + skip, n);
+      written += n;
+      skip = 0;
+    }
+
+    if (rc == BGZF_BAD_CRC)
+      E("CRC mismatch in the block at offset %zu", coffset);
+    if (rc)
+      E("Error uncompressing the block at offset %zu", coffset);
+  }
+
+  if (scratch) pfree(scratch);
+  return result;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_read);
+Datum pg_bgzip_read(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = PG_GETARG_BYTEA_PP(0);
+	int64 offset = PG_GETARG_INT64(1);
+	int64 length = PG_GETARG_INT64(2);
+
+	if (offset < 0 || length < 0)
+	  E("Invalid range: offset %ld and length %ld", (long)offset, (long)length);
+
+	PG_RETURN_BYTEA_P(bgzip_read_range((const uint8_t*)VARDATA_ANY(compressed),
+					   VARSIZE_ANY_EXHDR(compressed),
+					   0, (size_t)offset, (size_t)length));
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_read_indexed);
+Datum pg_bgzip_read_indexed(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = PG_GETARG_BYTEA_PP(0);
+	int64 offset = PG_GETARG_INT64(1);
+	int64 length = PG_GETARG_INT64(2);
+	bytea* index = PG_GETARG_BYTEA_PP(3);
+	size_t in_size = VARSIZE_ANY_EXHDR(compressed);
+	size_t coffset, skip;
+
+	if (offset < 0 || length < 0)
+	  E("Invalid range: offset %ld and length %ld", (long)offset, (long)length);
+
+	bgzip_gzi_seek(index, (size_t)offset, &coffset, &skip);
+
+	if (coffset > in_size)
+	  E("Index does not match the content: block at %zu, past the end", coffset);
+
+	PG_RETURN_BYTEA_P(bgzip_read_range((const uint8_t*)VARDATA_ANY(compressed), in_size,
+					   coffset, skip, (size_t)length));
+}
+
+/* BGZF virtual offset: coffset << 16 | uoffset */
+PG_FUNCTION_INFO_V1(pg_bgzip_read_virtual);
+Datum pg_bgzip_read_virtual(PG_FUNCTION_ARGS)
+{
+	bytea* compressed = PG_GETARG_BYTEA_PP(0);
+	uint64 voffset = (uint64)PG_GETARG_INT64(1);
+	int64 length = PG_GETARG_INT64(2);
+	size_t coffset = voffset >> 16;
+	size_t in_size = VARSIZE_ANY_EXHDR(compressed);
+
+	if (length < 0)
+	  E("Invalid length: %ld", (long)length);
+
+	if (coffset > in_size)
+	  E("Invalid virtual offset: block at %zu, past the end of the content", coffset);
+
+	PG_RETURN_BYTEA_P(bgzip_read_range((const uint8_t*)VARDATA_ANY(compressed), in_size,
+					   coffset, (size_t)(voffset & 0xffff), (size_t)length));
+}
+
+
+/*
+ * Large objects
+ *
+ * Past 1GB, content does not fit in a bytea. Large objects are read in batches of blocks,
+ * each batch compressed (or inflated) and written to a new large object, so memory stays
+ * constant whatever the size.
+ * When compressing on threads, the next batch is read while the threads work on the current one.
+ *
+ * The large objects go through the descriptors of be-fsstubs (as lo_open() and friends),
+ * not inv_api: that registers the end-of-transaction cleanup of pg_largeobject, and
+ * closes them on error.
+ */
+#define BGZIP_LO_BLOCKS BGZIP_SLICE_BLOCKS
+
+static int
+bgzip_lo_open(Oid oid, int mode)
+{
+  return DatumGetInt32(DirectFunctionCall2(be_lo_open, ObjectIdGetDatum(oid), Int32GetDatum(mode)));
+}
+
+static Oid
+bgzip_lo_create(void)
+{
+  return DatumGetObjectId(DirectFunctionCall1(be_lo_create, ObjectIdGetDatum(InvalidOid)));
+}
+
+static void
+bgzip_lo_close(int fd)
+{
+  DirectFunctionCall1(be_lo_close, Int32GetDatum(fd));
+}
+
+/* Size of the large object, leaving it at offset 0 */
+static int64
+bgzip_lo_size(int fd)
+{
+  int64 size = DatumGetInt64(DirectFunctionCall3(be_lo_lseek64, Int32GetDatum(fd),
+						  Int64GetDatum(0), Int32GetDatum(SEEK_END)));
+  DirectFunctionCall3(be_lo_lseek64, Int32GetDatum(fd), Int64GetDatum(0), Int32GetDatum(SEEK_SET));
+  return size;
+}
+
+/* Read up to size bytes. Returns fewer only at the end of the large object */
+static size_t
+bgzip_lo_read(int lo, uint8_t *buf, size_t size)
+{
+  size_t got = 0;
+  int n;
+
+  while (got < size) {
+    n = lo_read(lo, (char *)buf + got, (int)(size - got));
+    if (n <= 0) break;
+    got += n;
+  }
+  return got;
+}
+
+static void
+bgzip_lo_write(int lo, const uint8_t *buf, size_t size)
+{
+  int n;
+
+  while (size > 0) {
+    n = lo_write(lo, (const char *)buf, (int)size);
+    if (n <= 0)
+      E("Could not write to the large object");
+    buf += n;
+    size -= n;
+  }
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_lo);
+Datum pg_bgzip_compress_lo(PG_FUNCTION_ARGS)
+{
+	Oid src_oid = PG_GETARG_OID(0);
+	int32 compression_level = PG_GETARG_INT32(1);
+	bool with_eof = PG_GETARG_BOOL(2);
+	int src, dst;
+	Oid dst_oid;
+	bgzip_compress_job cj;
+	bgzip_job job;
+	uint8_t *inbuf[2];
+	size_t len, next_len, batch, failed;
+	int cur = 0, nthreads;
+	uint64 total_in = 0, total_out = 0;
+	int64 src_size;
+	bgzip_stats_call stats;
+
+	if (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL)
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	src = bgzip_lo_open(src_oid, INV_READ);
+	dst_oid = bgzip_lo_create();
+	dst = bgzip_lo_open(dst_oid, INV_WRITE);
+
+	/* its size, for the progress */
+	src_size = bgzip_lo_size(src);
+
+	batch = Max(BGZIP_LO_BLOCKS, 8 * (size_t)bgzip_max_threads);
+	inbuf[0] = (uint8_t*)palloc(batch * BGZF_BLOCK_SIZE);
+	inbuf[1] = (uint8_t*)palloc(batch * BGZF_BLOCK_SIZE);
+	cj.stride = bgzf_block_bound(bgzip_get_compressor(compression_level));
+	cj.out = (uint8_t*)palloc(batch * cj.stride);
+	cj.sizes = (size_t *)palloc(batch * sizeof(size_t));
+
+	nthreads = bgzip_max_threads;
+	bgzip_compress_job_init(&cj, compression_level, nthreads);
+	job.core.nthreads = 0;
+	bgzip_last_call_reset();
+	bgzip_stats_begin(&stats, BGZIP_FN_COMPRESS_LO, compression_level);
+	bgzip_progress_start(BGZIP_FN_COMPRESS_LO, src_size, (src_size + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE);
+
+	PG_TRY();
+	{
+	  len = bgzip_lo_read(src, inbuf[cur], batch * BGZF_BLOCK_SIZE);
+
+	  while (len > 0) {
+	    size_t nblocks = (len + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+	    size_t out_size;
+
+	    cj.in = inbuf[cur];
+	    cj.in_size = len;
+	    bgzip_job_start(&job, (int)Min((size_t)nthreads, nblocks), nblocks, bgzip_compress_task, &cj);
+
+	    /* meanwhile, read the next batch */
+	    next_len = (len == batch * BGZF_BLOCK_SIZE) ? bgzip_lo_read(src, inbuf[1 - cur], batch * BGZF_BLOCK_SIZE) : 0;
+
+	    failed = bgzip_job_wait(&job);
+	    if (failed != SIZE_MAX)
+	      E("Error compressing the block at position %lu", (unsigned long)(total_in + failed * BGZF_BLOCK_SIZE));
+
+	    bgzip_last_call.blocks += nblocks;
+	    out_size = bgzip_compress_job_pack(&cj, nblocks);
+	    bgzip_lo_write(dst, cj.out, out_size);
+
+	    total_in += len;
+	    total_out += out_size;
+	    cur = 1 - cur;
+	    len = next_len;
+	  }
+
+	  if (with_eof) {
+	    bgzip_lo_write(dst, bgzf_eof_marker, BGZF_EOF_LENGTH);
+	    total_out += BGZF_EOF_LENGTH;
+	  }
+	}
+	PG_CATCH();
+	{
+	  bgzip_job_abort(&job);
+	  bgzip_compress_job_free(&cj);
+	  PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	bgzip_compress_job_free(&cj);
+	bgzip_lo_close(src);
+	bgzip_lo_close(dst);
+	bgzip_last_call.stored_blocks = atomic_load(&cj.stored);
+	bgzip_stats_end(&stats, total_in, total_out, bgzip_last_call.blocks);
+	bgzip_progress_end();
+
+	D1("Compressed large object %u (%lu bytes) into %u (%lu bytes) with %d threads",
+	   src_oid, (unsigned long)total_in, dst_oid, (unsigned long)total_out, nthreads);
+
+	PG_RETURN_OID(dst_oid);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_uncompress_lo);
+Datum pg_bgzip_uncompress_lo(PG_FUNCTION_ARGS)
+{
+	Oid src_oid = PG_GETARG_OID(0);
+	bool verify = PG_GETARG_BOOL(1);
+	int src, dst;
+	Oid dst_oid;
+	uint8_t *inbuf, *outbuf;
+	size_t capacity, have = 0, got, walked, nblocks, usize, outcap = 0;
+	bgzf_block *blocks;
+	uint64 consumed = 0, total_out = 0, total_blocks = 0;
+	int nthreads;
+	bgzip_stats_call stats;
+
+	bgzip_stats_begin(&stats, BGZIP_FN_UNCOMPRESS_LO, BGZIP_NO_LEVEL);
+
+	src = bgzip_lo_open(src_oid, INV_READ);
+	dst_oid = bgzip_lo_create();
+	dst = bgzip_lo_open(dst_oid, INV_WRITE);
+
+	/* the number of blocks is not known in advance */
+	bgzip_progress_start(BGZIP_FN_UNCOMPRESS_LO, bgzip_lo_size(src), 0);
+
+	/* room for a batch, plus the partial block left over from the previous one */
+	capacity = (size_t)BGZIP_LO_BLOCKS * BGZF_MAX_BLOCK_SIZE + BGZF_MAX_BLOCK_SIZE;
+	inbuf = (uint8_t*)palloc(capacity);
+	outbuf = NULL;
+
+	for (;;) {
+
+	  got = bgzip_lo_read(src, inbuf + have, capacity - have);
+	  have += got;
+	  if (have == 0)
+	    break;
+
+	  /* the last block in the buffer might be incomplete: it stays for the next round */
+	  walked = bgzf_walk(inbuf, have, &blocks, &nblocks, &usize);
+	  if (nblocks == 0 || (got == 0 && walked != have))
+	    E("Invalid BGZF block at offset %lu", (unsigned long)(consumed + walked));
+
+	  /* exact size from the footers, and reused as long as it is large enough */
+	  if (usize > outcap) {
+	    if (outbuf) pfree(outbuf);
+	    outbuf = (uint8_t*)MemoryContextAllocHuge(CurrentMemoryContext, usize);
+	    outcap = usize;
+	  }
+
+	  nthreads = (nblocks < (size_t)bgzip_max_threads) ? (int)nblocks : bgzip_max_threads;
+	  bgzip_uncompress_parallel(outbuf, inbuf, blocks, nblocks, verify, nthreads, (size_t)consumed);
+	  bgzip_lo_write(dst, outbuf, usize);
+	  pfree(blocks);
+	  total_out += usize;
+	  total_blocks += nblocks;
+
+	  memmove(inbuf, inbuf + walked, have - walked);
+	  have -= walked;
+	  consumed += walked;
+	}
+
+	bgzip_lo_close(src);
+	bgzip_lo_close(dst);
+	bgzip_stats_end(&stats, consumed, total_out, total_blocks);
+	bgzip_progress_end();
+
+	PG_RETURN_OID(dst_oid);
+}
+
+/*
+ * Server-side files
+ *
+ * The source is read with pread, in batches of blocks processed on the thread pool: not
+ * mmap'ed, as another process truncating it would then crash the backend with SIGBUS.
+ * When compressing, the blocks of a batch are compressed first, then, once their
+ * offsets are known from the prefix sum of their sizes, written in parallel with pwrite.
+ * When uncompressing, the offsets come from the footers, so each block is inflated in
+ * a scratch buffer and written right away.
+ * Restricted to superusers, and to members of both pg_read_server_files and pg_write_server_files.
+ */
+#define BGZIP_FILE_BLOCKS 256 /* about 16MB */
+
+static void
+bgzip_check_file_access(void)
+{
+  if (!superuser() &&
+      !(has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES) &&
+	has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES)))
+    ereport(ERROR,
+	    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+	     errmsg("permission denied to (un)compress server files"),
+	     errhint("Only superusers, and roles with privileges of both pg_read_server_files and pg_write_server_files, may do so.")));
+}
+
+typedef struct bgzip_file {
+  char *path;
+  int fd;
+  size_t size;
+} bgzip_file;
+
+static void
+bgzip_file_open(bgzip_file *src, bgzip_file *dst, text *src_path, text *dst_path)
+{
+  struct stat st, dst_st;
+
+  src->path = text_to_cstring(src_path);
+  dst->path = text_to_cstring(dst_path);
+  dst->fd = -1;
+
+  src->fd = OpenTransientFile(src->path, O_RDONLY | PG_BINARY);
+  if (src->fd < 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not open file \"%s\": %m", src->path)));
+
+  if (fstat(src->fd, &st) < 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not stat file \"%s\": %m", src->path)));
+  src->size = st.st_size;
+
+  /*
+   * Not truncated on open: if it is the source itself (or a hard link to it), truncating
+   * would destroy the input
+   */
+  dst->fd = OpenTransientFile(dst->path, O_WRONLY | O_CREAT | PG_BINARY);
+  if (dst->fd < 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not create file \"%s\": %m", dst->path)));
+  if (fstat(dst->fd, &dst_st) < 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not stat file \"%s\": %m", dst->path)));
+  if (st.st_dev == dst_st.st_dev && st.st_ino == dst_st.st_ino)
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("\"%s\" and \"%s\" are the same file", src->path, dst->path)));
+  if (ftruncate(dst->fd, 0) < 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not truncate file \"%s\": %m", dst->path)));
+}
+
+/* Exactly size bytes at offset: the file shrinking meanwhile is an error */
+static void
+bgzip_file_read(bgzip_file *src, uint8_t *buf, size_t size, off_t offset)
+{
+  ssize_t n;
+
+  while (size > 0) {
+    n = pread(src->fd, buf, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ereport(ERROR, (errcode_for_file_access(), errmsg("could not read file \"%s\": %m", src->path)));
+    }
+    if (n == 0)
+      ereport(ERROR,
+	      (errcode(ERRCODE_DATA_CORRUPTED),
+	       errmsg("file \"%s\" was truncated while being read", src->path)));
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+/* The transient files are closed at abort anyway */
+static void
+bgzip_file_close(bgzip_file *src, bgzip_file *dst)
+{
+  CloseTransientFile(src->fd);
+  if (CloseTransientFile(dst->fd) != 0)
+    ereport(ERROR, (errcode_for_file_access(), errmsg("could not close file \"%s\": %m", dst->path)));
+}
+
+typedef struct bgzip_pwrite_job {
+  int fd;
+  const uint8_t *buf;
+  size_t stride;
+  const size_t *sizes;
+  const off_t *offsets;
+  int err;            /* errno of a failed write */
+} bgzip_pwrite_job;
+
+static int
+bgzip_pwrite_task(void *arg, size_t block, int worker)
+{
+  bgzip_pwrite_job *wj = (bgzip_pwrite_job *)arg;
+  const uint8_t *p = wj->buf + block * wj->stride;
+  size_t left = wj->sizes[block];
+  off_t offset = wj->offsets[block];
+  ssize_t n;
+
+  while (left > 0) {
+    n = pwrite(wj->fd, p, left, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      wj->err = errno;
+      return -1;
+    }
+    p += n;
+    left -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compress_file);
+Datum pg_bgzip_compress_file(PG_FUNCTION_ARGS)
+{
+	int32 compression_level = PG_GETARG_INT32(2);
+	bool with_eof = PG_GETARG_BOOL(3);
+	bgzip_file src, dst;
+	bgzip_compress_job cj;
+	bgzip_pwrite_job wj;
+	bgzip_job job;
+	size_t batch, nblocks, first, failed, i;
+	off_t *offsets;
+	off_t written = 0;
+	uint8_t *inbuf;
+	int nthreads;
+	bgzip_stats_call stats;
+
+	bgzip_check_file_access();
+
+	if (compression_level < -1 || compression_level > BGZIP_MAX_LEVEL)
+		elog(ERROR, "invalid compression level: %d", compression_level);
+
+	bgzip_file_open(&src, &dst, PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+
+	nblocks = (src.size + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+	batch = Max(BGZIP_FILE_BLOCKS, 16 * (size_t)bgzip_max_threads);
+	cj.stride = bgzf_block_bound(bgzip_get_compressor(compression_level));
+	cj.out = (uint8_t*)palloc(batch * cj.stride);
+	cj.sizes = (size_t *)palloc(batch * sizeof(size_t));
+	offsets = (off_t *)palloc(batch * sizeof(off_t));
+	inbuf = (uint8_t*)palloc(batch * BGZF_BLOCK_SIZE);
+
+	nthreads = bgzip_max_threads;
+	bgzip_compress_job_init(&cj, compression_level, nthreads);
+	job.core.nthreads = 0;
+	bgzip_last_call_reset();
+	bgzip_stats_begin(&stats, BGZIP_FN_COMPRESS_FILE, compression_level);
+	bgzip_progress_start(BGZIP_FN_COMPRESS_FILE, src.size, nblocks);
+
+	wj.fd = dst.fd;
+	wj.buf = cj.out;
+	wj.stride = cj.stride;
+	wj.sizes = cj.sizes;
+	wj.offsets = offsets;
+	wj.err = 0;
+
+	PG_TRY();
+	{
+	  for (first = 0; first < nblocks; first += batch) {
+
+	    size_t n = Min(batch, nblocks - first);
+	    int threads = (int)Min((size_t)nthreads, n);
+
+	    cj.in = inbuf;
+	    cj.in_size = Min(n * BGZF_BLOCK_SIZE, src.size - first * BGZF_BLOCK_SIZE);
+	    bgzip_file_read(&src, inbuf, cj.in_size, (off_t)(first * BGZF_BLOCK_SIZE));
+
+	    bgzip_job_start(&job, threads, n, bgzip_compress_task, &cj);
+	    failed = bgzip_job_wait(&job);
+	    if (failed != SIZE_MAX)
+	      E("Error compressing the block at position %zu", (first + failed) * BGZF_BLOCK_SIZE);
+
+	    /* where each block goes */
+	    for (i = 0; i < n; i++) {
+	      offsets[i] = written;
+	      written += cj.sizes[i];
+	    }
+
+	    bgzip_job_start(&job, threads, n, bgzip_pwrite_task, &wj);
+	    job.progress_unit = 0; /* those blocks are counted already */
+	    if (bgzip_job_wait(&job) != SIZE_MAX) {
+	      errno = wj.err;
+	      ereport(ERROR, (errcode_for_file_access(), errmsg("could not write to file \"%s\": %m", dst.path)));
+	    }
+	  }
+
+	  if (with_eof) {
+	    if (pwrite(dst.fd, bgzf_eof_marker, BGZF_EOF_LENGTH, written) != BGZF_EOF_LENGTH)
+	      ereport(ERROR, (errcode_for_file_access(), errmsg("could not write to file \"%s\": %m", dst.path)));
+	    written += BGZF_EOF_LENGTH;
+	  }
+	}
+	PG_CATCH();
+	{
+	  bgzip_job_abort(&job);
+	  bgzip_compress_job_free(&cj);
+	  PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	bgzip_compress_job_free(&cj);
+	bgzip_file_close(&src, &dst);
+	bgzip_last_call.blocks = nblocks;
+	bgzip_last_call.stored_blocks = atomic_load(&cj.stored);
+	bgzip_stats_end(&stats, src.size, written, nblocks);
+	bgzip_progress_end();
+
+	D1("Compressed %s (%zu bytes) into %s (%ld bytes) with %d threads",
+	   src.path, src.size, dst.path, (long)written, nthreads);
+
+	PG_RETURN_INT64((int64)written);
+}
+
+typedef struct bgzip_inflate_file_job {
+  int fd;
+  const uint8_t *in;  /* the blocks of the batch, read from the file */
+  size_t in_offset;   /* of in, in the file */
+  const bgzf_block *blocks;
+  bool verify;
+  int err;            /* errno of a failed write */
+  uint8_t *scratch;   /* BGZF_MAX_BLOCK_SIZE per worker */
+  struct libdeflate_decompressor *d[BGZF_MAX_THREADS];
+} bgzip_inflate_file_job;
+
+static int
+bgzip_inflate_file_task(void *arg, size_t block, int worker)
+{
+  bgzip_inflate_file_job *fj = (bgzip_inflate_file_job *)arg;
+  const bgzf_block *b = &fj->blocks[block];
+  uint8_t *p = fj->scratch + (size_t)worker * BGZF_MAX_BLOCK_SIZE;
+  size_t left = b->usize;
+  off_t offset = b->uoffset;
+  ssize_t n;
+  int rc;
+
+  rc = bgzf_uncompress_block(fj->d[worker], p, fj->in + (b->coffset - fj->in_offset), b, fj->verify);
+  if (rc)
+    return rc;
+
+  while (left > 0) {
+    n = pwrite(fj->fd, p, left, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fj->err = errno;
+      return -1;
+    }
+    p += n;
+    left -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_uncompress_file);
+Datum pg_bgzip_uncompress_file(PG_FUNCTION_ARGS)
+{
+	bgzip_file src, dst;
+	bgzip_inflate_file_job fj;
+	bgzip_job job;
+	bgzf_block *blocks;
+	uint8_t *inbuf;
+	size_t batch, n, len, offset, coffset = 0, uoffset = 0, failed, total_blocks = 0;
+	int t, nthreads = bgzip_max_threads;
+	bgzip_stats_call stats;
+
+	bgzip_check_file_access();
+
+	bgzip_file_open(&src, &dst, PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+
+	batch = Max(BGZIP_FILE_BLOCKS, 16 * (size_t)bgzip_max_threads);
+	blocks = (bgzf_block *)palloc(batch * sizeof(bgzf_block));
+	/* a batch of blocks always fits */
+	inbuf = (uint8_t*)palloc(batch * BGZF_MAX_BLOCK_SIZE);
+
+	fj.fd = dst.fd;
+	fj.in = inbuf;
+	fj.blocks = blocks;
+	fj.verify = PG_GETARG_BOOL(2);
+	fj.err = 0;
+	fj.scratch = (uint8_t*)palloc((size_t)bgzip_max_threads * BGZF_MAX_BLOCK_SIZE);
+
+	memset(fj.d, 0, sizeof(fj.d));
+	fj.d[0] = bgzip_get_decompressor();
+	for (t = 1; t < nthreads; t++)
+	  fj.d[t] = libdeflate_alloc_decompressor_ex(&libdeflate_job_options);
+	job.core.nthreads = 0;
+	bgzip_stats_begin(&stats, BGZIP_FN_UNCOMPRESS_FILE, BGZIP_NO_LEVEL);
+	bgzip_progress_start(BGZIP_FN_UNCOMPRESS_FILE, src.size, 0);
+
+	PG_TRY();
+	{
+	  while (coffset < src.size) {
+
+	    len = Min(src.size - coffset, batch * BGZF_MAX_BLOCK_SIZE);
+	    bgzip_file_read(&src, inbuf, len, (off_t)coffset);
+	    fj.in_offset = coffset;
+
+	    /* the next batch of blocks, from their headers. The last one read may be cut short */
+	    for (n = 0, offset = 0; n < batch && offset < len; n++) {
+	      if (bgzf_parse_block(inbuf + offset, len - offset, &blocks[n])) {
+		if (n > 0 && coffset + len < src.size)
+		  break;
+		E("Invalid BGZF block at offset %zu", coffset + offset);
+	      }
+	      blocks[n].coffset = coffset + offset;
+	      blocks[n].uoffset = uoffset;
+	      offset += blocks[n].csize;
+	      uoffset += blocks[n].usize;
+	    }
+	    coffset += offset;
+	    total_blocks += n;
+
+	    bgzip_job_start(&job, (int)Min((size_t)nthreads, n), n, bgzip_inflate_file_task, &fj);
+	    failed = bgzip_job_wait(&job);
+	    if (failed != SIZE_MAX) {
+	      /* inflate it again, to tell a bad block from a failed write */
+	      int rc = bgzf_uncompress_block(fj.d[0], fj.scratch, inbuf + (blocks[failed].coffset - fj.in_offset),
+					      &blocks[failed], fj.verify);
+	      if (rc == BGZF_BAD_CRC)
+		E("CRC mismatch in the block at offset %zu", blocks[failed].coffset);
+	      if (rc)
+		E("Error uncompressing the block at offset %zu", blocks[failed].coffset);
+	      errno = fj.err;
+	      ereport(ERROR, (errcode_for_file_access(), errmsg("could not write to file \"%s\": %m", dst.path)));
+	    }
+	  }
+	}
+	PG_CATCH();
+	{
+	  bgzip_job_abort(&job);
+	  for (t = 1; t < nthreads; t++)
+	    libdeflate_free_decompressor(fj.d[t]);
+	  PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (t = 1; t < nthreads; t++)
+	  libdeflate_free_decompressor(fj.d[t]);
+	bgzip_file_close(&src, &dst);
+	bgzip_stats_end(&stats, src.size, uoffset, total_blocks);
+	bgzip_progress_end();
+
+	D1("Uncompressed %s (%zu bytes) into %s (%zu bytes) with %d threads",
+	   src.path, src.size, dst.path, uoffset, nthreads);
+
+	PG_RETURN_INT64((int64)uoffset);
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_last_compress);
+Datum pg_bgzip_last_compress(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[2];
+	bool nulls[2] = { false, false };
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+	  E("Function returning record called in context that cannot accept type record");
+
+	values[0] = Int64GetDatum((int64)bgzip_last_call.blocks);
+	values[1] = Int64GetDatum((int64)bgzip_last_call.stored_blocks);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_stats);
+Datum pg_bgzip_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum values[9];
+	bool nulls[9] = { false, false, false, false, false, false, false, false, false };
+	int fn, slot;
+	char level[8];
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if(!bgzip_stats) /* not in shared_preload_libraries */
+	  return (Datum) 0;
+
+	for(fn = 0; fn < BGZIP_STATS_FNS; fn++)
+	  for(slot = 0; slot < BGZIP_STATS_SLOTS; slot++){
+	    bgzip_stats_entry *e = &bgzip_stats->entries[fn][slot];
+	    uint64 calls = pg_atomic_read_u64(&e->calls);
+
+	    if(calls == 0)
+	      continue;
+
+	    values[0] = CStringGetTextDatum(bgzip_stats_fn_names[fn]);
+	    nulls[1] = (slot == BGZIP_STATS_NONE);
+	    if(slot == BGZIP_STATS_AUTO)
+	      values[1] = CStringGetTextDatum("auto");
+	    else if(!nulls[1]) {
+	      snprintf(level, sizeof(level), "%d", slot);
+	      values[1] = CStringGetTextDatum(level);
+	    }
+	    values[2] = Int64GetDatum((int64)calls);
+	    values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&e->bytes_in));
+	    values[4] = Int64GetDatum((int64)pg_atomic_read_u64(&e->bytes_out));
+	    values[5] = Int64GetDatum((int64)pg_atomic_read_u64(&e->blocks));
+	    /* in milliseconds, like pg_stat_statements */
+	    values[6] = Float8GetDatum((double)pg_atomic_read_u64(&e->time_ns) / 1000000.0);
+	    values[7] = Float8GetDatum((double)pg_atomic_read_u64(&e->deflate_ns) / 1000000.0);
+	    values[8] = Float8GetDatum((double)pg_atomic_read_u64(&e->crc_ns) / 1000000.0);
+	    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	  }
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_progress);
+Datum pg_bgzip_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum values[6];
+	bool nulls[6];
+	bool all_stats;
+	int i, j;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if(!bgzip_progress) /* not in shared_preload_libraries */
+	  return (Datum) 0;
+
+	/* as pg_stat_progress_*: the details only for our own role's calls, or with pg_read_all_stats */
+	all_stats = has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+
+	for(i = 0; i < MaxBackends; i++){
+	  bgzip_progress_slot *p = &bgzip_progress[i];
+	  uint32 pid = pg_atomic_read_u32(&p->pid);
+	  uint64 total;
+
+	  if(pid == 0)
+	    continue;
+
+	  pg_read_barrier();
+	  values[0] = Int32GetDatum((int32)pid);
+	  nulls[0] = false;
+
+	  if(!all_stats && !has_privs_of_role(GetUserId(), p->userid)){
+	    for(j = 1; j < 6; j++)
+	      nulls[j] = true;
+	    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	    continue;
+	  }
+
+	  for(j = 1; j < 6; j++)
+	    nulls[j] = false;
+	  values[1] = CStringGetTextDatum(bgzip_stats_fn_names[p->fn]);
+	  values[2] = TimestampTzGetDatum(p->start);
+	  values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&p->blocks_done));
+	  total = pg_atomic_read_u64(&p->blocks_total);
+	  nulls[4] = (total == 0);
+	  values[4] = Int64GetDatum((int64)total);
+	  values[5] = Int64GetDatum((int64)pg_atomic_read_u64(&p->bytes_total));
+
+	  /* the call ended (or another started) while we were reading: skip it */
+	  pg_read_barrier();
+	  if(pg_atomic_read_u32(&p->pid) != pid)
+	    continue;
+
+	  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_stats_reset);
+Datum pg_bgzip_stats_reset(PG_FUNCTION_ARGS)
+{
+	int fn, slot;
+
+	if(!bgzip_stats)
+	  PG_RETURN_VOID();
+
+	/* counter by counter: a concurrent call may land half before, half after */
+	for(fn = 0; fn < BGZIP_STATS_FNS; fn++)
+	  for(slot = 0; slot < BGZIP_STATS_SLOTS; slot++){
+	    bgzip_stats_entry *e = &bgzip_stats->entries[fn][slot];
+	    pg_atomic_write_u64(&e->calls, 0);
+	    pg_atomic_write_u64(&e->bytes_in, 0);
+	    pg_atomic_write_u64(&e->bytes_out, 0);
+	    pg_atomic_write_u64(&e->blocks, 0);
+	    pg_atomic_write_u64(&e->time_ns, 0);
+	    pg_atomic_write_u64(&e->deflate_ns, 0);
+	    pg_atomic_write_u64(&e->crc_ns, 0);
+	  }
+
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compressor_cache);
+Datum pg_bgzip_compressor_cache(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum values[2];
+	bool nulls[2] = { false, false };
+	int level;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	for(level = BGZIP_MIN_LEVEL; level <= BGZIP_MAX_LEVEL; level++){
+	  if(!bgzip_compressors[level])
+	    continue;
+	  values[0] = Int32GetDatum(level);
+	  values[1] = Int64GetDatum((int64)bgzip_compressors_size[level]);
+	  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	if(bgzip_decompressor){
+	  nulls[0] = true; /* no level */
+	  values[1] = Int64GetDatum((int64)bgzip_decompressor_size);
+	  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_bgzip_compressor_cache_flush);
+Datum pg_bgzip_compressor_cache_flush(PG_FUNCTION_ARGS)
+{
+	int64 released = 0;
+
+	if(bgzip_cache_context){
+	  released = MemoryContextMemAllocated(bgzip_cache_context, true);
+	  MemoryContextDelete(bgzip_cache_context); /* fires bgzip_cache_reset */
+	}
+
+	PG_RETURN_INT64(released);
 }